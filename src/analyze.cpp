@@ -2,21 +2,79 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <cmath>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <condition_variable>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <random>
+#include <span>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <nlohmann/json.hpp>
+#include "hty_sketch.hpp"
 
-// Function to swap endianness if needed
-int32_t swap_endian(int32_t value) {
-    return ((value & 0xFF000000) >> 24) |
-           ((value & 0x00FF0000) >> 8) |
-           ((value & 0x0000FF00) << 8) |
-           ((value & 0x000000FF) << 24);
+// Function to swap the byte order of a 32-bit value (float fields are swapped
+// as their bit pattern)
+int32_t swap_endian_int(int32_t value) {
+    return static_cast<int32_t>(__builtin_bswap32(static_cast<uint32_t>(value)));
+}
+
+// Function to swap the byte order of a run of 32-bit values in place, four at
+// a time where SSE2 is available
+void swap_values(int32_t* values, size_t count) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));  // swap bytes in each 16-bit half
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);    // then swap the halves
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), v);
+    }
+#endif
+    for (; i < count; ++i) {
+        values[i] = swap_endian_int(values[i]);
+    }
+}
+
+// Function to load a 32-bit field stored big-endian whatever the host, such
+// as the metadata size that ends every .hty file
+int32_t load_big_endian(const char* field) {
+    int32_t value;
+    std::memcpy(&value, field, sizeof(value));
+    if constexpr (std::endian::native == std::endian::little) value = swap_endian_int(value);
+    return value;
 }
 
-// Function to swap endianness for float
-float swap_endian_float(float value) {
-    int32_t temp = *reinterpret_cast<int32_t*>(&value);
-    temp = swap_endian(temp);
-    return *reinterpret_cast<float*>(&temp);
+// Function to store a 32-bit value big-endian at `field`
+void store_big_endian(int32_t value, char* field) {
+    if constexpr (std::endian::native == std::endian::little) value = swap_endian_int(value);
+    std::memcpy(field, &value, sizeof(value));
 }
 
 nlohmann::json extract_metadata(const std::string& hty_file_path) {
@@ -33,15 +91,13 @@ nlohmann::json extract_metadata(const std::string& hty_file_path) {
         throw std::runtime_error("Failed to seek to metadata size.");
     }
 
-    int32_t metadata_size;
-    hty_file.read(reinterpret_cast<char*>(&metadata_size), sizeof(metadata_size));
+    char size_bytes[sizeof(int32_t)];
+    hty_file.read(size_bytes, sizeof(size_bytes));
     if (hty_file.fail()) {
         std::cerr << "Error: Did not read metadata size correctly.\n";
         throw std::runtime_error("Failed to read metadata size.");
     }
-
-    // Handle potential endianness of the metadata_size if necessary
-    metadata_size = swap_endian(metadata_size);  // Ensure this swap_endian function works correctly
+    int32_t metadata_size = load_big_endian(size_bytes);  // the size is always stored big-endian
     std::cout << "Metadata size read: " << metadata_size << std::endl;
 
     // Seek to the position of the metadata string
@@ -71,431 +127,2012 @@ nlohmann::json extract_metadata(const std::string& hty_file_path) {
     }
 }
 
+// Function to check whether an .hty file stores its values little-endian.
+// Files without "byte_order" in the footer are big-endian.
+bool is_little_endian(const nlohmann::json& metadata) {
+    return metadata.value("byte_order", "big") == "little";
+}
 
-// Function to swap endianness for integers
-int32_t swap_endian_int(int32_t value) {
-    return ((value & 0xFF000000) >> 24) |
-           ((value & 0x00FF0000) >> 8) |
-           ((value & 0x0000FF00) << 8) |
-           ((value & 0x000000FF) << 24);
+// Function to check whether the values of a file must be swapped on this host
+bool needs_swap(const nlohmann::json& metadata) {
+    return is_little_endian(metadata) != (std::endian::native == std::endian::little);
 }
 
+// Function to load one 32-bit field as stored, without any byte swapping
+int32_t load_raw(const char* field) {
+    int32_t raw;
+    std::memcpy(&raw, field, sizeof(raw));
+    return raw;
+}
 
-std::vector<int> project_single_column(nlohmann::json metadata, std::string hty_file_path, std::string projected_column) {
-    std::vector<int> column_data;
-    std::ifstream hty_file(hty_file_path, std::ios::binary);
-    if (!hty_file.is_open()) {
-        throw std::runtime_error("File not found or could not be opened.");
+
+// Where a column lives inside the raw data section. Plain values only, so the
+// scan path can copy it freely; the column's footer entry (with its "stats")
+// is looked up with find_column_metadata when needed.
+struct ColumnLocation {
+    int64_t group_offset;
+    int row_size;
+    int byte_offset;
+    bool is_float = false;  // column_type == "float", decided once for the scan loops
+    int64_t bloom_offset = -1;  // offset of its filters in the Bloom sidecar, -1 if none
+    size_t bloom_words = 0;
+};
+
+// Function to find a column's entry in the footer (in the first group holding it)
+const nlohmann::json* find_column_metadata(const nlohmann::json& metadata, const std::string& column_name) {
+    for (const auto& group : metadata["groups"]) {
+        for (const auto& col : group["columns"]) {
+            if (col["column_name"] == column_name) return &col;
+        }
     }
+    return nullptr;
+}
 
-    // Get the number of groups and rows from metadata
-    int num_groups = metadata["num_groups"];
-    int num_rows = metadata["num_rows"];
+// Function to find the group, row size and in-row offset of a column
+std::optional<ColumnLocation> find_column(const nlohmann::json& metadata, const std::string& column_name) {
+    for (const auto& group : metadata["groups"]) {
+        int row_size = 0;
+        int byte_offset = -1;
+        const nlohmann::json* found = nullptr;
+        for (const auto& col : group["columns"]) {
+            if (byte_offset < 0 && col["column_name"] == column_name) {
+                byte_offset = row_size;
+                found = &col;
+            }
+            row_size += (col["column_type"] == "float") ? sizeof(float) : sizeof(int32_t);
+        }
+        if (byte_offset >= 0) {
+            ColumnLocation loc{group["offset"].get<int64_t>(), row_size, byte_offset, (*found)["column_type"] == "float"};
+            if (found->contains("bloom")) {
+                loc.bloom_offset = (*found)["bloom"]["offset"].get<int64_t>();
+                loc.bloom_words = (*found)["bloom"]["words"].get<size_t>();
+            }
+            return loc;
+        }
+    }
+    return std::nullopt;
+}
 
-    // Iterate through each group to find the requested column
-    for (int i = 0; i < num_groups; ++i) {
-        auto group = metadata["groups"][i];
-        int num_columns = group["num_columns"];
-        int offset = group["offset"]; // Get the starting offset of this group
-
-        // Iterate through each column in the current group
-        for (int j = 0; j < num_columns; ++j) {
-            auto column = group["columns"][j];
-            std::string column_name = column["column_name"];
-            std::string column_type = column["column_type"];
-
-            // Check if the current column matches the projected column
-            if (column_name == projected_column) {
-                std::cout << "Found column: " << projected_column << " at offset: " << offset << std::endl;
-
-                // Calculate the size of each row based on the number of columns
-                int row_size = 0;
-                for (int k = 0; k < num_columns; ++k) {
-                    std::string type = group["columns"][k]["column_type"];
-                    if (type == "int") {
-                        row_size += sizeof(int32_t);
-                    } else if (type == "float") {
-                        row_size += sizeof(float);
-                    }
-                }
+// Function to locate a column that must exist
+ColumnLocation locate_column(const nlohmann::json& metadata, const std::string& column_name) {
+    std::optional<ColumnLocation> loc = find_column(metadata, column_name);
+    if (!loc) {
+        throw std::runtime_error("Column not found: " + column_name);
+    }
+    return *loc;
+}
 
-                std::cout << "Calculated row size: " << row_size << " bytes" << std::endl;
+// Function to evaluate a filter operation (0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=)
+bool evaluate_predicate(int lhs, int op, int rhs) {
+    switch (op) {
+        case 0: return lhs == rhs;
+        case 1: return lhs != rhs;
+        case 2: return lhs > rhs;
+        case 3: return lhs >= rhs;
+        case 4: return lhs < rhs;
+        case 5: return lhs <= rhs;
+    }
+    return false;
+}
 
-                // Now read the data for the specific column
-                for (int k = 0; k < num_rows; ++k) {
-                    // Calculate the current offset for the column value
-                    int current_offset = offset + k * row_size + (j * (column_type == "float" ? sizeof(float) : sizeof(int32_t)));
-                    hty_file.seekg(current_offset, std::ios::beg);
+// Function to decode one int or float field from a buffer of rows, swapping
+// it to host byte order when `swap` is set
+double decode_value(const char* field, bool is_float, bool swap) {
+    int32_t raw = load_raw(field);
+    if (swap) raw = swap_endian_int(raw);
+    if (is_float) {
+        float value;
+        std::memcpy(&value, &raw, sizeof(value));
+        return value;
+    }
+    return raw;
+}
 
-                    if (column_type == "int") {
-                        int32_t value;
-                        hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                        if (hty_file.fail()) {
-                            throw std::runtime_error("Failed to read integer data.");
-                        }
-                        // Swap endianness if necessary
-                        value = swap_endian_int(value);
-
-                    } else if (column_type == "float") {
-                        float value;
-                        hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                        if (hty_file.fail()) {
-                            throw std::runtime_error("Failed to read float data.");
-                        }
-                        value = swap_endian_float(value); // Swap endianness if needed
-                        column_data.push_back(static_cast<int>(value)); // Cast to int if needed
-                    }
-                }
-                break; // Exit the column loop once we find the column
-            }
+// Rows per block when the footer does not say; a block is a contiguous run of
+// rows in a group and the unit of sampling and Bloom filtering
+const int kDefaultBlockRows = 4096;
+
+// Function to get the number of rows per block recorded in the footer
+int block_rows(const nlohmann::json& metadata) {
+    return metadata.value("block_rows", kDefaultBlockRows);
+}
+
+// Function to read the rows [first_row, first_row + count) of a group
+void read_row_block(std::ifstream& hty_file, int64_t group_offset, int row_size, int first_row, int count, std::pmr::vector<char>& buffer) {
+    buffer.resize(static_cast<size_t>(count) * row_size);
+    hty_file.seekg(static_cast<std::streamoff>(group_offset) + static_cast<std::streamoff>(first_row) * row_size, std::ios::beg);
+    hty_file.read(buffer.data(), buffer.size());
+    if (hty_file.fail()) {
+        throw std::runtime_error("Failed to read row block at row " + std::to_string(first_row));
+    }
+}
+
+// Metadata compiled once into the lookups the scan path needs
+struct Schema {
+    int num_rows;
+    int rows_per_block;
+    std::vector<std::string> column_names;  // every column, in file order
+    std::unordered_map<std::string, ColumnLocation> columns;
+    std::string bloom_file_path;  // empty when the file has no Bloom sidecar
+    std::string bloom_id;  // the id the sidecar's header must carry
+    bool swap_bytes;  // values are stored in the other byte order than the host's
+};
+
+// Function to compile the metadata of an .hty file into a Schema
+Schema compile_schema(const nlohmann::json& metadata, const std::string& hty_file_path) {
+    Schema schema;
+    schema.num_rows = metadata["num_rows"];
+    schema.rows_per_block = block_rows(metadata);
+    schema.swap_bytes = needs_swap(metadata);
+    for (const auto& group : metadata["groups"]) {
+        for (const auto& col : group["columns"]) {
+            std::string name = col["column_name"];
+            if (schema.columns.count(name)) continue;  // the first group holding a column wins
+            schema.column_names.push_back(name);
+            schema.columns.emplace(name, locate_column(metadata, name));
         }
     }
 
-    hty_file.close();
-    return column_data;
+    // The sidecar is stored next to the .hty file
+    if (metadata.contains("bloom_file")) {
+        schema.bloom_file_path = metadata["bloom_file"].get<std::string>();
+        schema.bloom_id = metadata.value("bloom_id", "");
+        size_t slash = hty_file_path.find_last_of('/');
+        if (slash != std::string::npos) {
+            schema.bloom_file_path = hty_file_path.substr(0, slash + 1) + schema.bloom_file_path;
+        }
+    }
+    return schema;
 }
 
-std::vector<int> filter(nlohmann::json metadata, std::string hty_file_path, std::string projected_column, int operation, int filtered_value) {
-    std::vector<int> filtered_data;
-    std::ifstream hty_file(hty_file_path, std::ios::binary);
-    if (!hty_file.is_open()) {
-        throw std::runtime_error("File not found or could not be opened.");
+// Function to find a column in a compiled schema
+const ColumnLocation& locate_column(const Schema& schema, const std::string& column_name) {
+    auto it = schema.columns.find(column_name);
+    if (it == schema.columns.end()) {
+        throw std::runtime_error("Column not found: " + column_name);
     }
+    return it->second;
+}
 
-    // Find the number of rows
-    int num_rows = metadata["num_rows"];
-
-    // Loop through the groups in the metadata
-    for (const auto& group : metadata["groups"]) {
-        int num_columns = group["num_columns"];
-        int offset = group["offset"];
-
-        // Initialize variables to track column index and type
-        int column_offset = -1;
-        std::string column_type;
-        int column_byte_offset = 0;
-
-        // Find the target column index and its type
-        for (int j = 0; j < num_columns; ++j) {
-            auto column = group["columns"][j];
-            std::string column_name = column["column_name"];
-            column_type = column["column_type"];
-
-            if (column_name == projected_column) {
-                column_offset = j;
-                break;
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("File not found or could not be opened: " + path);
+        }
+        if (fstat(fd, &status_) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to stat " + path);
+        }
+        size_ = status_.st_size;
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Failed to map " + path);
             }
-            column_byte_offset += (column["column_type"] == "float") ? sizeof(float) : sizeof(int32_t);
+            data_ = static_cast<const char*>(data);
         }
+        close(fd);
+    }
 
-        if (column_offset == -1) continue;  // Skip if the column is not found
+    ~MappedFile() {
+        if (data_) munmap(const_cast<char*>(data_), size_);
+    }
 
-        int row_size = column_byte_offset + ((column_type == "float") ? sizeof(float) : sizeof(int32_t));
-        // Now read the data for filtering
-        for (int i = 0; i < num_rows; ++i) {
-            int current_offset = offset + i * row_size + column_byte_offset;
-            hty_file.seekg(current_offset, std::ios::beg);
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-            bool condition_met = false;
-            if (column_type == "int") {
-                int32_t value;
-                hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                value = swap_endian_int(value);
-
-                switch (operation) {
-                    case 0: condition_met = (value == filtered_value); break;
-                    case 1: condition_met = (value != filtered_value); break;
-                    case 2: condition_met = (value > filtered_value); break;
-                    case 3: condition_met = (value >= filtered_value); break;
-                    case 4: condition_met = (value < filtered_value); break;
-                    case 5: condition_met = (value <= filtered_value); break;
-                }
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
 
-                if (condition_met) filtered_data.push_back(value);
-            } 
-            else if (column_type == "float") {
-                float value;
-                hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                value = swap_endian_float(value);
-                
-                int int_value = static_cast<int>(value);
-                // Debug output for the read value
-
-                switch (operation) {
-                    case 0: condition_met = (int_value == filtered_value); break;
-                    case 1: condition_met = (int_value != filtered_value); break;
-                    case 2: condition_met = (int_value > filtered_value); break;
-                    case 3: condition_met = (int_value >= filtered_value); break;
-                    case 4: condition_met = (int_value < filtered_value); break;
-                    case 5: condition_met = (int_value <= filtered_value); break;
-                }
-                // Print filtering condition results
+    // The mapped file's identity, mtime and size as of mapping it
+    const struct stat& status() const { return status_; }
 
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    struct stat status_;
+};
 
-                if (condition_met) filtered_data.push_back(int_value);
-            }
+// Function to warn that a file's Bloom sidecar was written for another
+// version of the file, so its filters cannot be used
+void warn_bloom_mismatch(const Schema& schema) {
+    std::cerr << "Warning: Bloom filter file " << schema.bloom_file_path << " does not belong to this file, scanning every block.\n";
+}
+
+// Function to map the Bloom sidecar of a file, if it has one. A missing or
+// mismatched sidecar only costs block skipping, so it is reported and scans
+// go on.
+std::unique_ptr<MappedFile> map_bloom_file(const Schema& schema) {
+    if (schema.bloom_file_path.empty()) return nullptr;
+    std::unique_ptr<MappedFile> bloom;
+    try {
+        bloom = std::make_unique<MappedFile>(schema.bloom_file_path);
+    } catch (const std::exception&) {
+        std::cerr << "Warning: Bloom filter file " << schema.bloom_file_path << " is missing, scanning every block.\n";
+        return nullptr;
+    }
+    if (!bloom_header_matches(bloom->data(), bloom->size(), schema.bloom_id)) {
+        warn_bloom_mismatch(schema);
+        return nullptr;
+    }
+    return bloom;
+}
+
+// Function to move a fully written temporary file over `path`. Writers never
+// rewrite a file in place: a reader that has the old file mapped keeps the old
+// inode intact instead of faulting on a truncated mapping.
+void replace_file(const std::string& temp_path, const std::string& path) {
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Unable to replace " + path);
+    }
+}
+
+// A column's per-block Bloom filters, read on demand from the sidecar file or
+// probed in place when the sidecar is mapped
+struct BloomIndex {
+    std::ifstream file;
+    const MappedFile* mapped = nullptr;
+    int64_t offset = 0;
+    size_t num_words = 0;
+    int num_blocks = 0;  // 0 when the column has no filters
+    size_t filter_bytes = 0;
+    std::vector<char> buffer;  // one filter, when reading from disk
+};
+
+// Function to open the Bloom filters of a column if the writer built them.
+// `mapped` is the already mapped (and checked) sidecar, or null to read it
+// from disk.
+void open_bloom_index(const Schema& schema, const ColumnLocation& loc, const MappedFile* mapped, BloomIndex& index) {
+    if (loc.bloom_offset < 0 || schema.bloom_file_path.empty()) return;
+
+    if (mapped) {
+        index.mapped = mapped;
+    } else {
+        index.file.open(schema.bloom_file_path, std::ios::binary);
+        if (!index.file.is_open()) {
+            std::cerr << "Warning: Bloom filter file " << schema.bloom_file_path << " is missing, scanning every block.\n";
+            return;
+        }
+        char header[kBloomHeaderBytes];
+        index.file.read(header, sizeof(header));
+        if (index.file.fail() || !bloom_header_matches(header, sizeof(header), schema.bloom_id)) {
+            warn_bloom_mismatch(schema);
+            index.file.close();
+            return;
         }
     }
 
-    hty_file.close();
-    return filtered_data;
+    index.offset = loc.bloom_offset;
+    index.num_words = loc.bloom_words;
+    index.num_blocks = (schema.num_rows + schema.rows_per_block - 1) / schema.rows_per_block;
+    index.filter_bytes = index.num_words * 8;
+    if (!mapped) index.buffer.resize(index.filter_bytes);
 }
 
-std::vector<std::vector<int>> project(nlohmann::json metadata, std::string hty_file_path, std::vector<std::string> projected_columns) {
-    std::vector<std::vector<int>> projected_data;
-    std::ifstream hty_file(hty_file_path, std::ios::binary);
-    if (!hty_file.is_open()) {
-        throw std::runtime_error("File not found or could not be opened.");
+// Function to check whether a block may hold any of the values. Blocks without
+// a filter always may.
+bool block_may_contain(BloomIndex& index, int block, const std::pmr::vector<int>& values) {
+    if (block >= index.num_blocks) return true;
+
+    int64_t position = index.offset + static_cast<int64_t>(block) * index.filter_bytes;
+    const char* bytes;
+    if (index.mapped) {
+        if (position + index.filter_bytes > index.mapped->size()) {
+            throw std::runtime_error("Bloom filter for block " + std::to_string(block) + " is past the end of the sidecar");
+        }
+        bytes = index.mapped->data() + position;
+    } else {
+        index.file.seekg(position, std::ios::beg);
+        index.file.read(index.buffer.data(), index.buffer.size());
+        if (index.file.fail()) {
+            throw std::runtime_error("Failed to read Bloom filter for block " + std::to_string(block));
+        }
+        bytes = index.buffer.data();
+    }
+    for (int value : values) {
+        if (BloomFilter::might_contain(bytes, index.num_words, static_cast<uint32_t>(value))) return true;
     }
+    return false;
+}
 
-    // Get the number of rows
-    int num_rows = metadata["num_rows"];
-    
-    // Initialize the projected data structure first
-    projected_data.resize(projected_columns.size(), std::vector<int>(num_rows));
+// Rows per batch yielded by ScanCursor
+const int kBatchRows = 65536;
 
-    // Find the group containing all columns and calculate offsets
-    for (const auto& group : metadata["groups"]) {
-        int group_offset = group["offset"];
-        
-        // Calculate total row size for this group
-        int row_size = 0;
-        for (const auto& col : group["columns"]) {
-            std::string type = col["column_type"];
-            row_size += (type == "int") ? sizeof(int32_t) : sizeof(float);
+// Operation code for an IN-list predicate, next to the six comparison codes
+const int kOpIn = 6;
+
+// WHERE clause of a scan: `column [op] value`, or `column IN (in_list)` when op is kOpIn
+struct ScanPredicate {
+    std::string column;
+    int op;
+    int value = 0;
+    std::vector<int> in_list;
+};
+
+// Comparisons as statements write them, indexed by operation code
+const char* const kOperationNames[] = {"=", "!=", ">", ">=", "<", "<="};
+
+// Function to find the code of a comparison written as =, !=, >, >=, < or <=;
+// -1 for anything else
+int find_operation(const std::string& op) {
+    for (int i = 0; i < 6; ++i) {
+        if (op == kOperationNames[i]) return i;
+    }
+    return -1;
+}
+
+// Per-query arena. Read buffers, selection vectors, batches and staged
+// results are carved out of it and released together when the query ends,
+// so scans never free piecemeal or contend on the global allocator. It can be
+// seeded with a caller-owned buffer so small queries never reach the heap.
+using QueryArena = std::pmr::monotonic_buffer_resource;
+
+// Function to truncate float bits to the int the rest of this file works with
+int truncate_float_bits(int32_t raw) {
+    float value;
+    std::memcpy(&value, &raw, sizeof(value));
+    return static_cast<int>(value);
+}
+
+// One projected column of a batch, decoded to host byte order. Its values
+// are either gathered into `values` or, when the scan can hand them out
+// without copying, viewed in place in a mapped file through `view`.
+struct BatchColumn {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    explicit BatchColumn(const allocator_type& alloc = {}) : values(alloc) {}
+    BatchColumn(const BatchColumn& other, const allocator_type& alloc) : is_float(other.is_float), values(other.values, alloc), view(other.view) {}
+    BatchColumn(BatchColumn&& other, const allocator_type& alloc) : is_float(other.is_float), values(std::move(other.values), alloc), view(other.view) {}
+    BatchColumn(const BatchColumn&) = default;
+    BatchColumn(BatchColumn&&) = default;
+    BatchColumn& operator=(const BatchColumn&) = default;
+    BatchColumn& operator=(BatchColumn&&) = default;
+
+    bool is_float = false;
+    std::pmr::vector<int32_t> values;  // raw 32-bit values, reinterpret as float when is_float
+    std::span<const int32_t> view;  // the values in place instead, when non-empty
+
+    // The batch's raw values, wherever they live
+    const int32_t* data() const { return view.empty() ? values.data() : view.data(); }
+
+    float float_at(int row) const {
+        float value;
+        std::memcpy(&value, data() + row, sizeof(value));
+        return value;
+    }
+
+    // Value as the int the rest of this file works with (floats are truncated)
+    int int_at(int row) const {
+        return is_float ? truncate_float_bits(data()[row]) : data()[row];
+    }
+};
+
+// Columnar batch; every column holds exactly num_rows values
+struct Batch {
+    explicit Batch(std::pmr::memory_resource* arena = std::pmr::get_default_resource()) : columns(arena) {}
+
+    int num_rows = 0;
+    std::pmr::vector<BatchColumn> columns;
+};
+
+// Pull-based scan over projected columns (which may span groups) with an
+// optional predicate. Each call to next() reads at most batch_rows input rows,
+// so memory stays flat no matter how large the file is. Rows come either from
+// the file through reusable read buffers or, for a mapped file, straight from
+// the mapping. Every block is filtered into a selection bitmap first; its
+// popcount sizes the batch columns exactly before the matching rows are
+// gathered. All scratch memory comes from the query arena and is set up before
+// the first row is read, so the scan loops never allocate. Files stored in host
+// byte order are copied as is; others are swapped in bulk after gathering. An
+// unfiltered scan of a mapped file in host byte order copies nothing for a
+// column alone in its group: the batch views the column in the mapping.
+class ScanCursor {
+public:
+    ScanCursor(const nlohmann::json& metadata, const std::string& hty_file_path, const std::vector<std::string>& projected_columns,
+        std::optional<ScanPredicate> predicate = std::nullopt, std::pmr::memory_resource* arena = std::pmr::get_default_resource(),
+        int batch_rows = kBatchRows)
+        : file_(hty_file_path, std::ios::binary), arena_(arena), projected_(arena), projected_group_(arena), groups_(arena), selection_(arena), probes_(arena) {
+        if (!file_.is_open()) {
+            throw std::runtime_error("File not found or could not be opened.");
         }
+        init(compile_schema(metadata, hty_file_path), nullptr, projected_columns, std::move(predicate), batch_rows);
+    }
 
-        // Process each requested column
-        for (size_t proj_idx = 0; proj_idx < projected_columns.size(); ++proj_idx) {
-            const std::string& target_column = projected_columns[proj_idx];
-            
-            // Find column offset within the group
-            int column_byte_offset = 0;
-            bool column_found = false;
-            std::string column_type;
+    // Scan over a mapped file (and its mapped Bloom sidecar, if any)
+    ScanCursor(const Schema& schema, const MappedFile& data, const MappedFile* bloom, const std::vector<std::string>& projected_columns,
+        std::optional<ScanPredicate> predicate = std::nullopt, std::pmr::memory_resource* arena = std::pmr::get_default_resource(),
+        int batch_rows = kBatchRows)
+        : mapped_(&data), arena_(arena), projected_(arena), projected_group_(arena), groups_(arena), selection_(arena), probes_(arena) {
+        init(schema, bloom, projected_columns, std::move(predicate), batch_rows);
+    }
 
-            for (const auto& col : group["columns"]) {
-                if (col["column_name"] == target_column) {
-                    column_found = true;
-                    column_type = col["column_type"];
-                    break;
-                }
-                column_byte_offset += (col["column_type"] == "int") ? sizeof(int32_t) : sizeof(float);
-            }
-
-            if (!column_found) continue;
-
-            // Read data for this column
-            for (int row = 0; row < num_rows; ++row) {
-                int current_offset = group_offset + (row * row_size) + column_byte_offset;
-                hty_file.seekg(current_offset, std::ios::beg);
-
-                if (column_type == "int") {
-                    int32_t value;
-                    hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                    value = swap_endian_int(value);
-                    projected_data[proj_idx][row] = value;
-                } else if (column_type == "float") {
-                    float value;
-                    hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                    value = swap_endian_float(value);
-                    projected_data[proj_idx][row] = static_cast<int>(value);
+    const std::vector<std::string>& column_names() const { return names_; }
+
+    // The arena this query allocates from; batches should use it too
+    std::pmr::memory_resource* arena() const { return arena_; }
+
+    // Function to restrict the scan to rows [first_row, end_row), restarting it
+    void set_range(int first_row, int end_row) {
+        next_row_ = first_row;
+        end_row_ = end_row;
+    }
+
+    // Function to fill `batch` with the next matching rows; false once the scan is exhausted
+    bool next(Batch& batch) {
+        // A batch may be reused across cursors, so refresh its shape every time.
+        // Capacity is reserved once; per-block resizes then never reallocate.
+        batch.columns.resize(projected_.size());
+        for (size_t i = 0; i < projected_.size(); ++i) {
+            BatchColumn& column = batch.columns[i];
+            column.is_float = projected_[i].is_float;
+            column.view = {};
+            column.values.clear();
+            if (!can_view(i) && static_cast<int>(column.values.capacity()) < batch_rows_) column.values.reserve(batch_rows_);
+        }
+        batch.num_rows = 0;
+
+        // Skip ahead over ranges in which nothing matches
+        while (batch.num_rows == 0 && next_row_ < end_row_) {
+            int end_row = std::min(next_row_ + batch_rows_, end_row_);
+            while (next_row_ < end_row) {
+                int block = next_row_ / rows_per_block_;
+                int count = std::min((block + 1) * rows_per_block_, end_row) - next_row_;
+                if (probes_.empty() || block_may_contain(bloom_, block, probes_)) {
+                    scan_rows(next_row_, count, batch);
                 }
+                next_row_ += count;
+            }
+        }
+        return batch.num_rows > 0;
+    }
+
+private:
+    // Rows of one group are read together into a reusable buffer (or pointed
+    // at in the mapping)
+    struct GroupScan {
+        int64_t group_offset;
+        int row_size;
+        std::pmr::vector<char> buffer;
+        const char* rows = nullptr;
+    };
+
+    void init(const Schema& schema, const MappedFile* bloom, const std::vector<std::string>& projected_columns,
+        std::optional<ScanPredicate> predicate, int batch_rows) {
+        end_row_ = schema.num_rows;
+        rows_per_block_ = schema.rows_per_block;
+        swap_ = schema.swap_bytes;
+        batch_rows_ = batch_rows;
+        names_ = projected_columns;
+        predicate_ = std::move(predicate);
+        if (predicate_ && (predicate_->op < 0 || predicate_->op > kOpIn || (predicate_->op == kOpIn && predicate_->in_list.empty()))) {
+            throw std::runtime_error("Unknown filter operation: " + std::to_string(predicate_->op));
+        }
 
-                if (hty_file.fail()) {
-                    throw std::runtime_error("Failed to read data at offset " + std::to_string(current_offset));
+        for (const auto& name : projected_columns) {
+            const ColumnLocation& loc = locate_column(schema, name);
+            projected_group_.push_back(add_group(loc));
+            projected_.push_back(loc);
+        }
+        if (predicate_) {
+            filter_ = locate_column(schema, predicate_->column);
+            filter_group_ = add_group(filter_);
+            std::sort(predicate_->in_list.begin(), predicate_->in_list.end());
+            selection_.resize((rows_per_block_ + 63) / 64);
+
+            // Equality and IN-list predicates can skip blocks through Bloom filters
+            if (!filter_.is_float && (predicate_->op == 0 || predicate_->op == kOpIn)) {
+                if (predicate_->op == 0) {
+                    probes_.push_back(predicate_->value);
+                } else {
+                    probes_.assign(predicate_->in_list.begin(), predicate_->in_list.end());
+                }
+                if (!mapped_ || bloom) {
+                    open_bloom_index(schema, filter_, bloom, bloom_);
                 }
             }
         }
+
+        // Size the read buffers up front
+        for (auto& group : groups_) {
+            if (!mapped_) group.buffer.reserve(static_cast<size_t>(rows_per_block_) * group.row_size);
+        }
     }
 
-    hty_file.close();
+    int add_group(const ColumnLocation& loc) {
+        for (size_t g = 0; g < groups_.size(); ++g) {
+            if (groups_[g].group_offset == loc.group_offset) return g;
+        }
+        groups_.push_back({loc.group_offset, loc.row_size, std::pmr::vector<char>(arena_), nullptr});
+        return groups_.size() - 1;
+    }
 
-    // Print the results in CSV format
-    // Print header
-    for (size_t i = 0; i < projected_columns.size(); ++i) {
-        std::cout << projected_columns[i];
-        if (i < projected_columns.size() - 1) {
-            std::cout << ",";
+    // Function to check whether projected column `i` can be handed out as a
+    // view into the mapping: the scan is unfiltered, the file is in host byte
+    // order, the column is alone in its group (so its values are contiguous)
+    // and they are aligned for int32_t
+    bool can_view(size_t i) const {
+        const GroupScan& group = groups_[projected_group_[i]];
+        return mapped_ && !swap_ && !predicate_ && group.row_size == sizeof(int32_t) &&
+            reinterpret_cast<uintptr_t>(mapped_->data() + group.group_offset) % alignof(int32_t) == 0;
+    }
+
+    // Function to mark the rows of a block that pass `keep` in the selection
+    // bitmap and return how many did
+    template <bool Swap, typename Keep>
+    int fill_selection(const char* field, int row_size, int count, Keep keep) {
+        int selected = 0;
+        for (int word = 0; word * 64 < count; ++word) {
+            int end = std::min(64, count - word * 64);
+            const char* base = field + static_cast<size_t>(word) * 64 * row_size;
+            uint64_t bits = 0;
+            for (int b = 0; b < end; ++b) {
+                int32_t raw = load_raw(base + static_cast<size_t>(b) * row_size);
+                if constexpr (Swap) raw = swap_endian_int(raw);
+                int lhs = filter_.is_float ? truncate_float_bits(raw) : raw;
+                bits |= static_cast<uint64_t>(keep(lhs)) << b;
+            }
+            selection_[word] = bits;
+            selected += std::popcount(bits);
         }
+        return selected;
     }
-    std::cout << std::endl;
-    
 
-    // Print data rows
-    for (int row = 0; row < num_rows; ++row) {
-        for (size_t col = 0; col < projected_columns.size(); ++col) {
-            std::cout << projected_data[col][row];
-            if (col < projected_columns.size() - 1) {
-                std::cout << ",";
+    // Function to evaluate the predicate over a block, one tight loop per
+    // operation and byte order
+    template <bool Swap>
+    int select_rows(int count) {
+        const GroupScan& group = groups_[filter_group_];
+        const char* field = group.rows + filter_.byte_offset;
+        int v = predicate_->value;
+        switch (predicate_->op) {
+            case 0: return fill_selection<Swap>(field, group.row_size, count, [v](int x) { return x == v; });
+            case 1: return fill_selection<Swap>(field, group.row_size, count, [v](int x) { return x != v; });
+            case 2: return fill_selection<Swap>(field, group.row_size, count, [v](int x) { return x > v; });
+            case 3: return fill_selection<Swap>(field, group.row_size, count, [v](int x) { return x >= v; });
+            case 4: return fill_selection<Swap>(field, group.row_size, count, [v](int x) { return x < v; });
+            case 5: return fill_selection<Swap>(field, group.row_size, count, [v](int x) { return x <= v; });
+            case kOpIn: {
+                const std::vector<int>& list = predicate_->in_list;
+                return fill_selection<Swap>(field, group.row_size, count,
+                    [&list](int x) { return std::binary_search(list.begin(), list.end(), x); });
             }
         }
-        std::cout << std::endl;
+        throw std::runtime_error("Unknown filter operation: " + std::to_string(predicate_->op));
+    }
+
+    void scan_rows(int first_row, int count, Batch& batch) {
+        for (auto& group : groups_) {
+            if (mapped_) {
+                size_t start = static_cast<size_t>(group.group_offset) + static_cast<size_t>(first_row) * group.row_size;
+                if (start + static_cast<size_t>(count) * group.row_size > mapped_->size()) {
+                    throw std::runtime_error("Failed to read row block at row " + std::to_string(first_row));
+                }
+                group.rows = mapped_->data() + start;
+            } else {
+                read_row_block(file_, group.group_offset, group.row_size, first_row, count, group.buffer);
+                group.rows = group.buffer.data();
+            }
+        }
+
+        int selected = !predicate_ ? count : swap_ ? select_rows<true>(count) : select_rows<false>(count);
+        if (selected == 0) return;
+
+        // Size every column exactly, then gather
+        size_t out = batch.num_rows;
+        for (size_t i = 0; i < projected_.size(); ++i) {
+            const GroupScan& group = groups_[projected_group_[i]];
+            const char* field = group.rows + projected_[i].byte_offset;
+            BatchColumn& column = batch.columns[i];
+            if (can_view(i)) {
+                // Blocks of an unfiltered scan are consecutive, so the view just grows
+                const int32_t* first = column.view.empty() ? reinterpret_cast<const int32_t*>(field) : column.view.data();
+                column.view = {first, out + selected};
+                continue;
+            }
+            column.values.resize(out + selected);
+            int32_t* values = column.values.data() + out;
+            if (!predicate_ && group.row_size == sizeof(int32_t)) {
+                std::memcpy(values, field, static_cast<size_t>(count) * sizeof(int32_t));  // a column alone in its group
+            } else if (!predicate_) {
+                for (int r = 0; r < count; ++r) {
+                    values[r] = load_raw(field + static_cast<size_t>(r) * group.row_size);
+                }
+            } else {
+                int32_t* next = values;
+                for (int word = 0; word * 64 < count; ++word) {
+                    for (uint64_t bits = selection_[word]; bits != 0; bits &= bits - 1) {
+                        int r = word * 64 + std::countr_zero(bits);
+                        *next++ = load_raw(field + static_cast<size_t>(r) * group.row_size);
+                    }
+                }
+            }
+            if (swap_) swap_values(values, selected);
+        }
+        batch.num_rows += selected;
+    }
+
+    std::ifstream file_;
+    const MappedFile* mapped_ = nullptr;
+    std::pmr::memory_resource* arena_;
+    int end_row_ = 0;
+    int rows_per_block_ = kDefaultBlockRows;
+    bool swap_ = true;
+    int batch_rows_ = kBatchRows;
+    int next_row_ = 0;
+    std::vector<std::string> names_;
+    std::pmr::vector<ColumnLocation> projected_;
+    std::pmr::vector<int> projected_group_;
+    std::pmr::vector<GroupScan> groups_;
+    std::optional<ScanPredicate> predicate_;
+    ColumnLocation filter_;
+    int filter_group_ = -1;
+    std::pmr::vector<uint64_t> selection_;
+    std::pmr::vector<int> probes_;
+    BloomIndex bloom_;
+};
+
+// Function to gather every batch of a cursor into one vector per column. Each
+// batch is staged in the query arena at its exact size; once the total row
+// count is known the results are allocated once, exactly, and filled.
+std::vector<std::vector<int>> collect_result_set(ScanCursor& cursor) {
+    std::pmr::memory_resource* arena = cursor.arena();
+    size_t num_columns = cursor.column_names().size();
+    std::pmr::vector<std::pmr::vector<int>> staged(arena);  // one entry per (batch, column)
+    size_t total_rows = 0;
+
+    Batch batch(arena);
+    while (cursor.next(batch)) {
+        for (const auto& column : batch.columns) {
+            std::pmr::vector<int>& chunk = staged.emplace_back(batch.num_rows);
+            for (int r = 0; r < batch.num_rows; ++r) {
+                chunk[r] = column.int_at(r);
+            }
+        }
+        total_rows += batch.num_rows;
+    }
+
+    std::vector<std::vector<int>> result(num_columns, std::vector<int>(total_rows));
+    size_t row = 0;
+    for (size_t chunk = 0; chunk < staged.size(); chunk += num_columns) {
+        for (size_t col = 0; col < num_columns; ++col) {
+            std::copy(staged[chunk + col].begin(), staged[chunk + col].end(), result[col].begin() + row);
+        }
+        row += staged[chunk].size();
     }
+    return result;
+}
+
+std::vector<int> project_single_column(nlohmann::json metadata, std::string hty_file_path, std::string projected_column) {
+    if (!find_column(metadata, projected_column)) return {};  // Nothing to return if the column is not found
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, {projected_column}, std::nullopt, &arena);
+    return std::move(collect_result_set(cursor)[0]);
+}
+
+std::vector<int> filter(nlohmann::json metadata, std::string hty_file_path, std::string projected_column, int operation, int filtered_value) {
+    if (!find_column(metadata, projected_column)) return {};  // Nothing to return if the column is not found
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, {projected_column}, ScanPredicate{projected_column, operation, filtered_value, {}}, &arena);
+    return std::move(collect_result_set(cursor)[0]);
+}
 
-    return projected_data;
+// Function to keep the values of a column that appear in an IN-list
+std::vector<int> filter_in(nlohmann::json metadata, std::string hty_file_path, std::string projected_column, std::vector<int> values) {
+    if (!find_column(metadata, projected_column) || values.empty()) return {};
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, {projected_column}, ScanPredicate{projected_column, kOpIn, 0, values}, &arena);
+    return std::move(collect_result_set(cursor)[0]);
+}
+
+std::vector<std::vector<int>> project(nlohmann::json metadata, std::string hty_file_path, std::vector<std::string> projected_columns) {
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, projected_columns, std::nullopt, &arena);
+    return collect_result_set(cursor);
 }
 
 std::vector<std::vector<int>> project_and_filter(nlohmann::json metadata, std::string hty_file_path, 
     std::vector<std::string> projected_columns, std::string filtered_column, int op, int value) {
-    
-    std::vector<std::vector<int>> filtered_data;
-    std::ifstream hty_file(hty_file_path, std::ios::binary);
-    if (!hty_file.is_open()) {
-        throw std::runtime_error("File not found or could not be opened.");
+    // Columns may come from different groups; the cursor reads each group it needs
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, projected_columns, ScanPredicate{filtered_column, op, value, {}}, &arena);
+    return collect_result_set(cursor);
+}
+
+// Function to print a cursor's rows as CSV, batch by batch, as they are read
+void display_batches(ScanCursor& cursor, bool with_header = true) {
+    const std::vector<std::string>& names = cursor.column_names();
+    for (size_t i = 0; with_header && i < names.size(); ++i) {
+        std::cout << names[i];
+        if (i < names.size() - 1) {
+            std::cout << ",";
+        }
+    }
+    if (with_header) std::cout << "\n";
+
+    Batch batch(cursor.arena());
+    while (cursor.next(batch)) {
+        for (int row = 0; row < batch.num_rows; ++row) {
+            for (size_t col = 0; col < batch.columns.size(); ++col) {
+                std::cout << batch.columns[col].int_at(row);
+                if (col < batch.columns.size() - 1) {
+                    std::cout << ",";
+                }
+            }
+            std::cout << "\n";
+        }
     }
+    std::cout << std::flush;
+}
 
-    nlohmann::json target_group;
-    
-    // Add filtered_column to the list of columns we need to find
-    std::vector<std::string> all_needed_columns = projected_columns;
-    all_needed_columns.push_back(filtered_column);
+// Rows formatted per export task; tasks are written out in file order
+const int kExportChunkRows = 65536;
 
-    // Find the group containing all needed columns
-    for (const auto& group : metadata["groups"]) {
-        bool all_columns_found = true;
-        for (const auto& needed_col : all_needed_columns) {
-            bool found = false;
+// Upper bound on the text of one value: sign, 10 digits or a shortest float, ".0"
+const int kMaxValueChars = 24;
+
+// Function to append one value of a batch column as CSV text at `out`
+char* format_value(char* out, char* end, const BatchColumn& column, int row) {
+    if (!column.is_float) {
+        return std::to_chars(out, end, column.data()[row]).ptr;
+    }
+    // Shortest text that reads back as the same float, keeping a decimal
+    // point so downstream tools still see a float column
+    char* start = out;
+    out = std::to_chars(out, end, column.float_at(row)).ptr;
+    if (std::find_if(start, out, [](char c) { return c == '.' || c == 'e' || c == 'n' || c == 'i'; }) == out) {
+        *out++ = '.';
+        *out++ = '0';
+    }
+    return out;
+}
+
+// Growable buffer for CSV text. Room is reserved ahead of formatting without
+// being zero-filled, and text is written through a pointer into it.
+class TextBuffer {
+public:
+    const char* data() const { return data_.get(); }
+    size_t size() const { return size_; }
+    void clear() { size_ = 0; }
+
+    void swap(TextBuffer& other) noexcept {
+        data_.swap(other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+
+    // Function to make room for `bytes` more and return where to write them
+    char* reserve(size_t bytes) {
+        if (size_ + bytes > capacity_) {
+            size_t capacity = std::max(size_ + bytes, 2 * capacity_);
+            std::unique_ptr<char[]> data(new char[capacity]);  // deliberately uninitialized
+            if (size_ > 0) std::memcpy(data.get(), data_.get(), size_);
+            data_ = std::move(data);
+            capacity_ = capacity;
+        }
+        return data_.get() + size_;
+    }
+
+    // Function to mark the reserved space up to `end` as written
+    void commit(const char* end) { size_ = end - data_.get(); }
+
+    void append(const std::string& text) {
+        if (text.empty()) return;
+        char* out = reserve(text.size());
+        std::memcpy(out, text.data(), text.size());
+        commit(out + text.size());
+    }
+
+private:
+    std::unique_ptr<char[]> data_;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+};
+
+// Function to append a batch as CSV rows to `text`
+void format_batch(const Batch& batch, TextBuffer& text) {
+    size_t bytes = static_cast<size_t>(batch.num_rows) * batch.columns.size() * (kMaxValueChars + 1) + batch.num_rows;
+    char* out = text.reserve(bytes);
+    char* end = out + bytes;
+    for (int row = 0; row < batch.num_rows; ++row) {
+        for (size_t col = 0; col < batch.columns.size(); ++col) {
+            if (col > 0) *out++ = ',';
+            out = format_value(out, end, batch.columns[col], row);
+        }
+        *out++ = '\n';
+    }
+    text.commit(out);
+}
+
+// Function to export columns of an .hty file to CSV, optionally filtered.
+// The file is mapped once and shared. Worker threads each scan and format
+// chunks of kExportChunkRows rows into their own buffers; the calling thread
+// writes finished chunks in order with one large write each. At most
+// 2 * num_threads chunks are in flight, so memory stays bounded. An empty
+// column list exports every column. The CSV appears only once it is complete.
+// Returns the number of rows written.
+size_t export_to_csv(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& csv_file_path,
+    std::vector<std::string> columns, const std::optional<ScanPredicate>& predicate, int num_threads) {
+    if (columns.empty()) {
+        for (const auto& group : metadata["groups"]) {
             for (const auto& col : group["columns"]) {
-                if (col["column_name"] == needed_col) {
-                    found = true;
-                    break;
-                }
+                columns.push_back(col["column_name"]);
             }
-            if (!found) {
-                all_columns_found = false;
-                break;
+        }
+    }
+    num_threads = std::max(1, num_threads);
+
+    // Catch unknown columns and operations before any output exists
+    MappedFile data(hty_file_path);
+    Schema schema = compile_schema(metadata, hty_file_path);
+    std::unique_ptr<MappedFile> bloom = map_bloom_file(schema);
+    {
+        QueryArena arena;
+        ScanCursor check(schema, data, bloom.get(), columns, predicate, &arena, kExportChunkRows);
+    }
+
+    std::string temp_path = csv_file_path + ".tmp";
+    std::ofstream csv_file(temp_path, std::ios::binary);
+    if (!csv_file.is_open()) {
+        throw std::runtime_error("Unable to open CSV file for writing: " + temp_path);
+    }
+    std::string header;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        header += (i ? "," : "") + columns[i];
+    }
+    header += "\n";
+    csv_file.write(header.data(), header.size());
+
+    int num_rows = metadata["num_rows"];
+    int num_chunks = (num_rows + kExportChunkRows - 1) / kExportChunkRows;
+    int num_slots = 2 * num_threads;
+
+    // Chunk c is handed over through slot c % num_slots
+    std::vector<TextBuffer> slots(num_slots);
+    std::vector<int> slot_chunk(num_slots, -1);
+    std::vector<size_t> slot_rows(num_slots, 0);
+    std::mutex mutex;
+    std::condition_variable changed;
+    int next_to_write = 0;
+    bool failed = false;
+    std::exception_ptr error;
+    std::atomic<int> next_chunk{0};
+
+    auto worker = [&]() {
+        try {
+            // Each worker owns its arena, so scans never share an allocator
+            QueryArena arena;
+            ScanCursor cursor(schema, data, bloom.get(), columns, predicate, &arena, kExportChunkRows);
+            Batch batch(&arena);
+            TextBuffer text;
+            int chunk;
+            while ((chunk = next_chunk++) < num_chunks) {
+                int first_row = chunk * kExportChunkRows;
+                cursor.set_range(first_row, std::min(first_row + kExportChunkRows, num_rows));
+                text.clear();
+                size_t rows = 0;
+                while (cursor.next(batch)) {
+                    format_batch(batch, text);
+                    rows += batch.num_rows;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return failed || chunk < next_to_write + num_slots; });
+                if (failed) return;
+                int slot = chunk % num_slots;
+                slots[slot].swap(text);
+                slot_rows[slot] = rows;
+                slot_chunk[slot] = chunk;
+                changed.notify_all();
             }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!failed) error = std::current_exception();
+            failed = true;
+            changed.notify_all();
         }
-        if (all_columns_found) {
-            target_group = group;
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::min(num_threads, std::max(num_chunks, 1)); ++t) {
+        threads.emplace_back(worker);
+    }
+
+    size_t rows_written = 0;
+    TextBuffer pending;
+    for (int chunk = 0; chunk < num_chunks; ++chunk) {
+        int slot = chunk % num_slots;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return failed || slot_chunk[slot] == chunk; });
+            if (failed) break;
+            pending.swap(slots[slot]);
+            rows_written += slot_rows[slot];
+            slot_chunk[slot] = -1;
+            next_to_write = chunk + 1;
+            changed.notify_all();
+        }
+        csv_file.write(pending.data(), pending.size());
+        if (csv_file.fail()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+            error = std::make_exception_ptr(std::runtime_error("Failed to write CSV file: " + csv_file_path));
+            changed.notify_all();
             break;
         }
     }
 
-    if (target_group.empty()) {
-        throw std::runtime_error("Not all columns are in the same group");
+    for (auto& thread : threads) thread.join();
+    csv_file.close();
+    if (!error && csv_file.fail()) {
+        error = std::make_exception_ptr(std::runtime_error("Failed to write CSV file: " + csv_file_path));
+    }
+    if (error) {
+        std::remove(temp_path.c_str());
+        std::rethrow_exception(error);
     }
+    replace_file(temp_path, csv_file_path);
+    return rows_written;
+}
 
-    // Get basic information
-    int num_rows = metadata["num_rows"];
-    int group_offset = target_group["offset"];
+// Function to parse the footer of a mapped .hty file
+nlohmann::json metadata_from_mapping(const MappedFile& file) {
+    if (file.size() < sizeof(int32_t)) {
+        throw std::runtime_error("File is too small to hold metadata.");
+    }
+    int32_t metadata_size = load_big_endian(file.data() + file.size() - sizeof(int32_t));
+    if (metadata_size < 0 || static_cast<size_t>(metadata_size) > file.size() - sizeof(int32_t)) {
+        throw std::runtime_error("Failed to read metadata size.");
+    }
+    const char* metadata_start = file.data() + file.size() - sizeof(int32_t) - metadata_size;
+    try {
+        return nlohmann::json::parse(metadata_start, metadata_start + metadata_size);
+    } catch (const nlohmann::json::parse_error& e) {
+        throw std::runtime_error(std::string("Failed to parse metadata: ") + e.what());
+    }
+}
 
-    // Calculate row size and column offsets
-    int row_size = 0;
-    std::vector<std::pair<int, std::string>> column_offsets;  // offset and type for projected columns
-    int filter_column_offset = -1;
-    std::string filter_column_type;
+// An .hty file kept warm by the query server: the data and Bloom sidecar stay
+// mapped and the metadata stays compiled. Entries are immutable; queries hold
+// a shared_ptr so a replaced entry lives until its last query finishes.
+struct CachedTable {
+    std::unique_ptr<MappedFile> data;
+    std::unique_ptr<MappedFile> bloom;
+    Schema schema;
+};
+
+// Function to check whether a path still names the file a table mapped
+bool same_file(const struct stat& mapped, const struct stat& current) {
+    return mapped.st_dev == current.st_dev && mapped.st_ino == current.st_ino && mapped.st_size == current.st_size &&
+           mapped.st_mtim.tv_sec == current.st_mtim.tv_sec && mapped.st_mtim.tv_nsec == current.st_mtim.tv_nsec;
+}
 
-    // First pass: calculate row size and store column offsets
-    int current_offset = 0;
-    for (const auto& col : target_group["columns"]) {
-        std::string col_name = col["column_name"];
-        std::string col_type = col["column_type"];
-        int col_size = (col_type == "int") ? sizeof(int32_t) : sizeof(float);
+// Most files the query server keeps mapped at once
+const size_t kMaxCachedTables = 16;
+
+// Opened files by path, reloaded when the path names another file (a writer
+// renamed a new one into place) or the file's mtime or size changes. A path
+// that no longer opens is dropped, and past kMaxCachedTables entries the least
+// recently used one is evicted; queries still running on it keep it alive.
+class TableCache {
+public:
+    std::shared_ptr<const CachedTable> get(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tables_.erase(path);
+            throw std::runtime_error("File not found or could not be opened: " + path);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = tables_.find(path);
+            if (it != tables_.end() && same_file(it->second.table->data->status(), st)) {
+                it->second.last_used = ++clock_;
+                return it->second.table;
+            }
+        }
+
+        // Load outside the lock so other files stay available meanwhile
+        auto table = std::make_shared<CachedTable>();
+        try {
+            table->data = std::make_unique<MappedFile>(path);
+            table->schema = compile_schema(metadata_from_mapping(*table->data), path);
+            table->bloom = map_bloom_file(table->schema);
+        } catch (const std::exception&) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tables_.erase(path);
+            throw;
+        }
 
-        // Store offset for projected columns
-        for (const auto& proj_col : projected_columns) {
-            if (col_name == proj_col) {
-                column_offsets.push_back({current_offset, col_type});
+        std::lock_guard<std::mutex> lock(mutex_);
+        tables_[path] = {table, ++clock_};
+        while (tables_.size() > kMaxCachedTables) {
+            auto oldest = tables_.begin();
+            for (auto it = tables_.begin(); it != tables_.end(); ++it) {
+                if (it->second.last_used < oldest->second.last_used) oldest = it;
             }
+            tables_.erase(oldest);
         }
+        return table;
+    }
 
-        // Store offset for filter column
-        if (col_name == filtered_column) {
-            filter_column_offset = current_offset;
-            filter_column_type = col_type;
+private:
+    struct Entry {
+        std::shared_ptr<const CachedTable> table;
+        uint64_t last_used;
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Entry> tables_;
+    uint64_t clock_ = 0;
+};
+
+// A server statement:
+//   SELECT <column, ... | *> FROM <file> [WHERE <column> <op> <int> | WHERE <column> IN (<int>, ...)]
+// with op one of =, !=, >, >=, <, <=
+struct Statement {
+    std::string file;
+    std::vector<std::string> columns;  // empty for *
+    std::optional<ScanPredicate> predicate;
+};
+
+// Function to split a statement into words, operators and , ( ) tokens
+std::vector<std::string> tokenize_statement(const std::string& text) {
+    std::vector<std::string> tokens;
+    size_t i = 0;
+    while (i < text.size()) {
+        char c = text[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            ++i;
+        } else if (c == ',' || c == '(' || c == ')') {
+            tokens.emplace_back(1, c);
+            ++i;
+        } else if (std::strchr("=!<>", c)) {
+            size_t end = i;
+            while (end < text.size() && std::strchr("=!<>", text[end])) ++end;
+            tokens.push_back(text.substr(i, end - i));
+            i = end;
+        } else {
+            size_t end = i;
+            while (end < text.size() && !std::isspace(static_cast<unsigned char>(text[end])) && !std::strchr(",()=!<>", text[end])) ++end;
+            tokens.push_back(text.substr(i, end - i));
+            i = end;
         }
+    }
+    return tokens;
+}
 
-        current_offset += col_size;
-        row_size += col_size;
+// Function to compare a token with a keyword, ignoring case
+bool is_keyword(const std::string& token, const char* keyword) {
+    return strcasecmp(token.c_str(), keyword) == 0;
+}
+
+// Function to parse a server statement
+Statement parse_statement(const std::string& text) {
+    std::vector<std::string> tokens = tokenize_statement(text);
+    size_t pos = 0;
+    auto next_token = [&]() -> const std::string& {
+        if (pos >= tokens.size()) throw std::runtime_error("Unexpected end of statement.");
+        return tokens[pos++];
+    };
+
+    Statement statement;
+    if (!is_keyword(next_token(), "SELECT")) throw std::runtime_error("Statements must start with SELECT.");
+    while (true) {
+        const std::string& column = next_token();
+        if (column != "*") statement.columns.push_back(column);
+        if (pos < tokens.size() && tokens[pos] == ",") {
+            ++pos;
+            continue;
+        }
+        break;
     }
+    if (!is_keyword(next_token(), "FROM")) throw std::runtime_error("Expected FROM.");
+    statement.file = next_token();
+
+    if (pos < tokens.size()) {
+        if (!is_keyword(next_token(), "WHERE")) throw std::runtime_error("Expected WHERE.");
+        ScanPredicate predicate;
+        predicate.column = next_token();
+        const std::string& op = next_token();
+        predicate.op = find_operation(op);
+        if (is_keyword(op, "IN")) {
+            predicate.op = kOpIn;
+            if (next_token() != "(") throw std::runtime_error("Expected ( after IN.");
+            while (true) {
+                predicate.in_list.push_back(std::stoi(next_token()));
+                const std::string& separator = next_token();
+                if (separator == ")") break;
+                if (separator != ",") throw std::runtime_error("Expected , or ) in IN-list.");
+            }
+        } else if (predicate.op < 0) {
+            throw std::runtime_error("Unknown operation: " + op);
+        } else {
+            predicate.value = std::stoi(next_token());
+        }
+        statement.predicate = predicate;
+    }
+    if (pos != tokens.size()) throw std::runtime_error("Unexpected text after statement: " + tokens[pos]);
+    return statement;
+}
 
-    // Initialize result vectors
-    std::vector<std::vector<int>> result(projected_columns.size());
+// Function to write a parsed statement back out as text
+std::string format_statement(const Statement& statement) {
+    std::string text = "SELECT ";
+    for (size_t i = 0; i < statement.columns.size(); ++i) {
+        text += (i ? ", " : "") + statement.columns[i];
+    }
+    if (statement.columns.empty()) text += "*";
+    text += " FROM " + statement.file;
+    if (statement.predicate) {
+        const ScanPredicate& predicate = *statement.predicate;
+        text += " WHERE " + predicate.column;
+        if (predicate.op == kOpIn) {
+            text += " IN (";
+            for (size_t i = 0; i < predicate.in_list.size(); ++i) {
+                text += (i ? ", " : "") + std::to_string(predicate.in_list[i]);
+            }
+            text += ")";
+        } else {
+            text += std::string(" ") + kOperationNames[predicate.op] + " " + std::to_string(predicate.value);
+        }
+    }
+    return text;
+}
 
-    // Read and filter data
-    for (int row = 0; row < num_rows; ++row) {
-        // First read and check the filter column
-        int row_offset = group_offset + (row * row_size);
-        hty_file.seekg(row_offset + filter_column_offset, std::ios::beg);
+// Results are streamed in frames of about this many bytes
+const size_t kFrameBytes = 1 << 20;
+
+// Raised when a client hangs up mid-response
+struct ClientDisconnected : std::runtime_error {
+    ClientDisconnected() : std::runtime_error("Client disconnected.") {}
+};
+
+// Function to write a whole buffer to a socket
+void send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            throw ClientDisconnected();
+        }
+        data += sent;
+        size -= sent;
+    }
+}
+
+// Function to send one frame: a big-endian 32-bit length, then the bytes.
+// An empty frame ends a response.
+void send_frame(int fd, const char* data, size_t size) {
+    char length[sizeof(int32_t)];
+    store_big_endian(static_cast<int32_t>(size), length);
+    send_all(fd, length, sizeof(length));
+    send_all(fd, data, size);
+}
+
+void send_frame(int fd, const std::string& payload) {
+    send_frame(fd, payload.data(), payload.size());
+}
+
+// Append-only log of the statements a server ran, one per line, for the
+// layout advisor. Shared by all connections. File paths in it are absolute, so
+// the advisor can match them from any directory.
+class QueryLog {
+public:
+    explicit QueryLog(const std::string& path) : file_(path, std::ios::app) {
+        if (!file_.is_open()) {
+            throw std::runtime_error("Unable to open query log: " + path);
+        }
+    }
 
-        bool include_row = false;
-        if (filter_column_type == "int") {
-            int32_t filter_value;
-            hty_file.read(reinterpret_cast<char*>(&filter_value), sizeof(filter_value));
-            filter_value = swap_endian_int(filter_value);
+    void append(const std::string& statement) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_ << statement << '\n' << std::flush;
+    }
+
+private:
+    std::ofstream file_;
+    std::mutex mutex_;
+};
+
+// Scratch memory each connection lends to the arena of every statement it
+// runs; statements needing more spill over to the heap
+const size_t kStatementScratchBytes = 4 << 20;
+
+// Function to run one statement and stream its CSV result to a client. All of
+// its scratch memory comes from `arena`. Statements that ran to completion are
+// logged when `log` is set, with the absolute path of the file they read.
+void run_statement(TableCache& cache, const std::string& text, int fd, QueryArena& arena, TextBuffer& out, QueryLog* log) {
+    Statement statement = parse_statement(text);
+    // Relative paths are resolved against the server's directory, once, so the
+    // cache and the query log both see the file the server actually opened
+    statement.file = std::filesystem::weakly_canonical(statement.file).string();
+    std::shared_ptr<const CachedTable> table = cache.get(statement.file);
+    const std::vector<std::string>& columns = statement.columns.empty() ? table->schema.column_names : statement.columns;
+    ScanCursor cursor(table->schema, *table->data, table->bloom.get(), columns, statement.predicate, &arena);
+    Batch batch(&arena);
+
+    std::string header;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        header += (i ? "," : "") + columns[i];
+    }
+    out.clear();
+    out.append(header + "\n");
+    while (cursor.next(batch)) {
+        format_batch(batch, out);
+        if (out.size() >= kFrameBytes) {
+            send_frame(fd, out.data(), out.size());
+            out.clear();
+        }
+    }
+    send_frame(fd, out.data(), out.size());
+    if (log) log->append(format_statement(statement));
+}
+
+// A client connection of the query server. Statements run one at a time and
+// in order, so responses never interleave; `running` marks a connection whose
+// next statement is queued for or held by a worker.
+struct Connection {
+    int fd;
+    std::string pending;                 // bytes after the last complete statement
+    std::queue<std::string> statements;  // complete statements waiting to run
+    bool running = false;
+    bool reading_done = false;           // the client hung up or the socket failed
+    bool failed = false;                 // a response could not be sent
+};
+
+// Function to move the complete, non-blank lines of `pending` into `statements`
+void split_statements(std::string& pending, std::queue<std::string>& statements) {
+    size_t start = 0;
+    size_t newline;
+    while ((newline = pending.find('\n', start)) != std::string::npos) {
+        std::string text = pending.substr(start, newline - start);
+        start = newline + 1;
+        // Must match is_statement in hty_client.cpp, which never sends a blank line
+        if (text.find_first_not_of(" \t\r") != std::string::npos) statements.push(std::move(text));
+    }
+    pending.erase(0, start);
+}
+
+// Function to run one statement for a client and end its response. Returns
+// false when the client went away.
+bool serve_statement(TableCache& cache, const std::string& text, int fd, std::vector<std::byte>& scratch, TextBuffer& out, QueryLog* log) {
+    try {
+        try {
+            QueryArena arena(scratch.data(), scratch.size());
+            run_statement(cache, text, fd, arena, out, log);
+        } catch (const ClientDisconnected&) {
+            throw;
+        } catch (const std::exception& e) {
+            send_frame(fd, std::string("ERROR: ") + e.what() + "\n");
+        }
+        send_frame(fd, "");
+        return true;
+    } catch (const ClientDisconnected&) {
+        return false;
+    }
+}
+
+// Function to run the query server on a Unix domain socket. One thread polls
+// every connection and queues each complete statement as a task for a shared
+// pool of num_threads workers, so idle clients hold no worker. Opened files
+// stay mapped in a cache shared by all. Statements that run successfully are
+// appended to `query_log_path` when it is not empty.
+int run_server(const std::string& socket_path, int num_threads, const std::string& query_log_path) {
+    std::unique_ptr<QueryLog> log;
+    if (!query_log_path.empty()) {
+        try {
+            log = std::make_unique<QueryLog>(query_log_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Error: Unable to create socket.\n";
+        return 1;
+    }
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: Socket path is too long.\n";
+        close(listen_fd);
+        return 1;
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    // Only a stale socket from an earlier server may be replaced; anything
+    // else at that path (a mistyped data file, say) is left alone
+    struct stat existing;
+    if (lstat(socket_path.c_str(), &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            std::cerr << "Error: " << socket_path << " exists and is not a socket.\n";
+            close(listen_fd);
+            return 1;
+        }
+        unlink(socket_path.c_str());
+    }
+    if (bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listen_fd, 128) != 0) {
+        std::cerr << "Error: Unable to listen on " << socket_path << ".\n";
+        close(listen_fd);
+        return 1;
+    }
 
-            switch (op) {
-                case 0: include_row = (filter_value == value); break;
-                case 1: include_row = (filter_value != value); break;
-                case 2: include_row = (filter_value > value); break;
-                case 3: include_row = (filter_value >= value); break;
-                case 4: include_row = (filter_value < value); break;
-                case 5: include_row = (filter_value <= value); break;
+    // Workers wake the polling thread through this pipe when a connection
+    // becomes idle, so it can close connections that are done
+    int wake[2];
+    if (pipe(wake) != 0) {
+        std::cerr << "Error: Unable to create pipe.\n";
+        close(listen_fd);
+        return 1;
+    }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+
+    TableCache cache;
+    std::mutex mutex;  // guards every Connection, `runnable` and `stopping`
+    std::condition_variable ready;
+    std::queue<std::shared_ptr<Connection>> runnable;
+    bool stopping = false;
+
+    auto worker = [&]() {
+        std::vector<std::byte> scratch(kStatementScratchBytes);
+        TextBuffer out;
+        while (true) {
+            std::shared_ptr<Connection> connection;
+            std::string text;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&] { return stopping || !runnable.empty(); });
+                if (stopping) return;
+                connection = runnable.front();
+                runnable.pop();
+                text = std::move(connection->statements.front());
+                connection->statements.pop();
             }
-        } else { // float
-            float filter_value;
-            hty_file.read(reinterpret_cast<char*>(&filter_value), sizeof(filter_value));
-            filter_value = swap_endian_float(filter_value);
-            int int_filter_value = static_cast<int>(filter_value);
 
-            switch (op) {
-                case 0: include_row = (int_filter_value == value); break;
-                case 1: include_row = (int_filter_value != value); break;
-                case 2: include_row = (int_filter_value > value); break;
-                case 3: include_row = (int_filter_value >= value); break;
-                case 4: include_row = (int_filter_value < value); break;
-                case 5: include_row = (int_filter_value <= value); break;
+            bool sent = serve_statement(cache, text, connection->fd, scratch, out, log.get());
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!sent) {
+                    connection->failed = true;
+                    connection->statements = {};
+                }
+                if (!connection->statements.empty()) {
+                    runnable.push(connection);
+                    ready.notify_one();
+                } else {
+                    connection->running = false;
+                }
             }
+            char byte = 0;
+            [[maybe_unused]] ssize_t woken = write(wake[1], &byte, 1);  // a full pipe already means a wakeup is pending
         }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::max(1, num_threads); ++t) {
+        threads.emplace_back(worker);
+    }
 
-        // If row passes filter, read projected columns
-        if (include_row) {
-            for (size_t i = 0; i < column_offsets.size(); ++i) {
-                hty_file.seekg(row_offset + column_offsets[i].first, std::ios::beg);
-                
-                if (column_offsets[i].second == "int") {
-                    int32_t value;
-                    hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                    value = swap_endian_int(value);
-                    result[i].push_back(value);
-                } else { // float
-                    float value;
-                    hty_file.read(reinterpret_cast<char*>(&value), sizeof(value));
-                    value = swap_endian_float(value);
-                    result[i].push_back(static_cast<int>(value));
+    std::cout << "Serving on " << socket_path << " with " << threads.size() << " threads" << std::endl;
+    std::unordered_map<int, std::shared_ptr<Connection>> connections;
+    std::vector<pollfd> polled;
+    char buffer[65536];
+    while (true) {
+        polled.assign({{listen_fd, POLLIN, 0}, {wake[0], POLLIN, 0}});
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = connections.begin(); it != connections.end();) {
+                Connection& connection = *it->second;
+                if ((connection.reading_done || connection.failed) && !connection.running) {
+                    close(connection.fd);
+                    it = connections.erase(it);
+                    continue;
                 }
+                if (!connection.reading_done && !connection.failed) polled.push_back({connection.fd, POLLIN, 0});
+                ++it;
+            }
+        }
+
+        if (poll(polled.data(), polled.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: poll failed.\n";
+            break;
+        }
+        if (polled[1].revents) {
+            while (read(wake[0], buffer, sizeof(buffer)) > 0) {}
+        }
+        if (polled[0].revents & POLLIN) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) {
+                auto connection = std::make_shared<Connection>();
+                connection->fd = fd;
+                connections[fd] = connection;
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                std::cerr << "Error: accept failed.\n";
+                break;
+            }
+        }
+
+        for (size_t i = 2; i < polled.size(); ++i) {
+            if (!polled[i].revents) continue;
+            // Only this thread reads, so a readable socket does not block
+            ssize_t received = recv(polled[i].fd, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR) continue;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            Connection& connection = *connections[polled[i].fd];
+            if (received <= 0) {
+                connection.reading_done = true;
+                continue;
+            }
+            connection.pending.append(buffer, received);
+            split_statements(connection.pending, connection.statements);
+            if (!connection.running && !connection.statements.empty()) {
+                connection.running = true;
+                runnable.push(connections[polled[i].fd]);
+                ready.notify_one();
             }
         }
     }
 
-    hty_file.close();
+    // Let workers finish their statements, then release everything they use
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& thread : threads) thread.join();
+    for (const auto& entry : connections) close(entry.first);
+    close(wake[0]);
+    close(wake[1]);
+    close(listen_fd);
+    return 1;
+}
 
-    // Print results in CSV format
-    // Print header
-    for (size_t i = 0; i < projected_columns.size(); ++i) {
-        std::cout << projected_columns[i];
-        if (i < projected_columns.size() - 1) {
-            std::cout << ",";
+// Per block, each group a query reads costs one more seek and read on top of
+// its bytes; the advisor charges that as this many bytes
+const double kGroupBlockOverheadBytes = 4096;
+
+// Function to read the column sets a workload touches on one file. The log
+// holds one server statement per line (a server query log, or a batch file of
+// client statements); statements on other files are ignored. Each distinct
+// set of column indices (into schema.column_names) maps to how often it occurs.
+std::map<std::vector<int>, int> load_workload(const std::string& log_path, const std::string& hty_file_path, const Schema& schema) {
+    std::ifstream log(log_path);
+    if (!log.is_open()) {
+        throw std::runtime_error("Unable to open query log: " + log_path);
+    }
+    std::unordered_map<std::string, int> index;
+    for (size_t i = 0; i < schema.column_names.size(); ++i) {
+        index[schema.column_names[i]] = i;
+    }
+    std::filesystem::path target = std::filesystem::weakly_canonical(hty_file_path);
+
+    std::map<std::vector<int>, int> workload;
+    std::string line;
+    int skipped = 0;
+    while (std::getline(log, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        try {
+            Statement statement = parse_statement(line);
+            if (std::filesystem::weakly_canonical(statement.file) != target) continue;
+
+            std::vector<int> columns;
+            if (statement.columns.empty()) {
+                columns.resize(schema.column_names.size());
+                std::iota(columns.begin(), columns.end(), 0);
+            }
+            for (const auto& name : statement.columns) {
+                columns.push_back(index.at(name));
+            }
+            if (statement.predicate) columns.push_back(index.at(statement.predicate->column));
+            std::sort(columns.begin(), columns.end());
+            columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+            ++workload[columns];
+        } catch (const std::exception&) {
+            ++skipped;  // unparsable statements and unknown columns
         }
     }
-    std::cout << std::endl;
+    if (skipped > 0) {
+        std::cerr << "Warning: Skipped " << skipped << " statements that could not be used.\n";
+    }
+    return workload;
+}
+
+// Function to estimate the bytes a workload reads under a layout (groups of
+// column indices with per-column widths in bytes)
+double workload_bytes(const std::vector<std::vector<int>>& layout, const std::vector<int>& widths,
+    const std::map<std::vector<int>, int>& workload, int num_rows, int rows_per_block) {
+    std::vector<int> group_of(widths.size());
+    std::vector<double> group_bytes(layout.size(), 0.0);
+    for (size_t g = 0; g < layout.size(); ++g) {
+        for (int col : layout[g]) {
+            group_of[col] = g;
+            group_bytes[g] += static_cast<double>(widths[col]) * num_rows;
+        }
+    }
+    double num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+    double total = 0.0;
+    for (const auto& [columns, count] : workload) {
+        std::vector<bool> touched(layout.size(), false);
+        for (int col : columns) touched[group_of[col]] = true;
+        for (size_t g = 0; g < layout.size(); ++g) {
+            if (touched[g]) total += count * (group_bytes[g] + num_blocks * kGroupBlockOverheadBytes);
+        }
+    }
+    return total;
+}
 
-    // Print data rows
-    for (size_t row = 0; row < result[0].size(); ++row) {
-        for (size_t col = 0; col < result.size(); ++col) {
-            std::cout << result[col][row];
-            if (col < result.size() - 1) {
-                std::cout << ",";
+// Function to choose column groups that minimize the bytes a workload reads.
+// Columns touched by exactly the same queries always go together (splitting
+// them can only add overhead). Groups are then merged greedily, best saving
+// first, while merging saves more per-group overhead than the extra bytes it
+// makes the queries that need only one side read.
+std::vector<std::vector<int>> advise_layout(const std::vector<int>& widths, const std::map<std::vector<int>, int>& workload,
+    int num_rows, int rows_per_block) {
+    std::vector<std::pair<std::vector<int>, int>> queries(workload.begin(), workload.end());
+
+    // Group columns by the set of queries that touch them
+    std::map<std::vector<bool>, std::vector<int>> by_signature;
+    for (size_t col = 0; col < widths.size(); ++col) {
+        std::vector<bool> signature(queries.size());
+        for (size_t q = 0; q < queries.size(); ++q) {
+            signature[q] = std::binary_search(queries[q].first.begin(), queries[q].first.end(), static_cast<int>(col));
+        }
+        by_signature[signature].push_back(col);
+    }
+    std::vector<std::vector<int>> layout;
+    std::vector<std::vector<bool>> touches;  // touches[g][q]: query q reads group g
+    for (auto& [signature, columns] : by_signature) {
+        layout.push_back(std::move(columns));
+        touches.push_back(signature);
+    }
+
+    double num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+    auto group_bytes = [&](const std::vector<int>& group) {
+        double bytes = 0.0;
+        for (int col : group) bytes += static_cast<double>(widths[col]) * num_rows;
+        return bytes;
+    };
+    while (layout.size() > 1) {
+        double best = 0.0;
+        size_t best_i = 0, best_j = 0;
+        for (size_t i = 0; i < layout.size(); ++i) {
+            for (size_t j = i + 1; j < layout.size(); ++j) {
+                double bytes_i = group_bytes(layout[i]);
+                double bytes_j = group_bytes(layout[j]);
+                double delta = 0.0;
+                for (size_t q = 0; q < queries.size(); ++q) {
+                    if (touches[i][q] && touches[j][q]) {
+                        delta -= queries[q].second * num_blocks * kGroupBlockOverheadBytes;
+                    } else if (touches[i][q]) {
+                        delta += queries[q].second * bytes_j;
+                    } else if (touches[j][q]) {
+                        delta += queries[q].second * bytes_i;
+                    }
+                }
+                if (delta < best) {
+                    best = delta;
+                    best_i = i;
+                    best_j = j;
+                }
             }
         }
-        std::cout << std::endl;
+        if (best >= 0.0) break;
+
+        layout[best_i].insert(layout[best_i].end(), layout[best_j].begin(), layout[best_j].end());
+        std::sort(layout[best_i].begin(), layout[best_i].end());
+        for (size_t q = 0; q < queries.size(); ++q) {
+            touches[best_i][q] = touches[best_i][q] || touches[best_j][q];
+        }
+        layout.erase(layout.begin() + best_j);
+        touches.erase(touches.begin() + best_j);
     }
 
-    return result;
+    // Groups in file order of their first column
+    std::sort(layout.begin(), layout.end());
+    return layout;
+}
+
+// Function to parse a layout such as "id,type;salary": groups separated by ';',
+// columns by ','
+std::vector<std::vector<std::string>> parse_layout(const std::string& spec) {
+    std::vector<std::vector<std::string>> groups;
+    std::stringstream groups_in(spec);
+    std::string group_text;
+    while (std::getline(groups_in, group_text, ';')) {
+        std::vector<std::string> group;
+        std::stringstream columns_in(group_text);
+        std::string name;
+        while (std::getline(columns_in, name, ',')) {
+            if (!name.empty()) group.push_back(name);
+        }
+        if (!group.empty()) groups.push_back(group);
+    }
+    return groups;
+}
+
+// Function to format a layout the way parse_layout reads it
+std::string format_layout(const std::vector<std::vector<std::string>>& groups) {
+    std::string spec;
+    for (size_t g = 0; g < groups.size(); ++g) {
+        if (g > 0) spec += ";";
+        for (size_t c = 0; c < groups[g].size(); ++c) {
+            spec += (c ? "," : "") + groups[g][c];
+        }
+    }
+    return spec;
+}
+
+// Function to print the advised layout for a workload and return it
+std::vector<std::vector<std::string>> advise_file_layout(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& log_path) {
+    Schema schema = compile_schema(metadata, hty_file_path);
+    std::map<std::vector<int>, int> workload = load_workload(log_path, hty_file_path, schema);
+    int num_queries = 0;
+    for (const auto& entry : workload) num_queries += entry.second;
+    if (num_queries == 0) {
+        throw std::runtime_error("The query log has no statements on " + hty_file_path);
+    }
+
+    std::vector<int> widths;
+    std::unordered_map<std::string, int> index;
+    for (const auto& name : schema.column_names) {
+        index[name] = widths.size();
+        widths.push_back(locate_column(schema, name).is_float ? sizeof(float) : sizeof(int32_t));
+    }
+    std::vector<std::vector<int>> current;
+    for (const auto& group : metadata["groups"]) {
+        std::vector<int> columns;
+        for (const auto& col : group["columns"]) {
+            columns.push_back(index.at(col["column_name"].get<std::string>()));
+        }
+        current.push_back(columns);
+    }
+
+    std::vector<std::vector<int>> advised = advise_layout(widths, workload, schema.num_rows, schema.rows_per_block);
+    std::vector<std::vector<std::string>> groups;
+    for (const auto& group : advised) {
+        std::vector<std::string> names;
+        for (int col : group) names.push_back(schema.column_names[col]);
+        groups.push_back(names);
+    }
+
+    double before = workload_bytes(current, widths, workload, schema.num_rows, schema.rows_per_block);
+    double after = workload_bytes(advised, widths, workload, schema.num_rows, schema.rows_per_block);
+    std::cout << "Workload: " << num_queries << " statements, " << workload.size() << " distinct column sets\n";
+    for (size_t g = 0; g < groups.size(); ++g) {
+        std::cout << "Group " << g << ": " << format_layout({groups[g]}) << "\n";
+    }
+    std::cout << "Layout: " << format_layout(groups) << "\n";
+    std::cout << "Estimated MB read: " << before / 1e6 << " now, " << after / 1e6 << " with this layout" << std::endl;
+    return groups;
+}
+
+// Function to rewrite an .hty file with its columns in the given groups.
+// Column statistics and Bloom filters describe columns, not layout, so they
+// carry over; the Bloom sidecar is copied next to the new file. Values are
+// written little-endian when `little_endian` is set and big-endian otherwise.
+void relayout_file(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& out_path,
+    const std::vector<std::vector<std::string>>& groups, bool little_endian) {
+    Schema schema = compile_schema(metadata, hty_file_path);
+    std::unordered_map<std::string, int> placed;
+    for (const auto& group : groups) {
+        for (const auto& name : group) {
+            locate_column(schema, name);  // throws for unknown columns
+            if (placed[name]++) throw std::runtime_error("Column is in more than one group: " + name);
+        }
+    }
+    for (const auto& name : schema.column_names) {
+        if (!placed.count(name)) throw std::runtime_error("Column is in no group: " + name);
+    }
+    if (std::filesystem::exists(out_path) && std::filesystem::equivalent(out_path, hty_file_path)) {
+        throw std::runtime_error("Cannot rewrite a file in place: " + out_path);
+    }
+
+    std::string temp_path = out_path + ".tmp";
+    std::ofstream out_file(temp_path, std::ios::binary);
+    if (!out_file.is_open()) {
+        throw std::runtime_error("Unable to open HTY file for writing: " + temp_path);
+    }
+
+    nlohmann::json new_metadata = metadata;
+    new_metadata.erase("byte_order");
+    if (little_endian) new_metadata["byte_order"] = "little";
+    bool swap = needs_swap(new_metadata);
+
+    nlohmann::json new_groups = nlohmann::json::array();
+    int64_t offset = 0;
+    std::vector<int32_t> rows;
+    for (const auto& group : groups) {
+        nlohmann::json group_metadata;
+        group_metadata["num_columns"] = group.size();
+        group_metadata["offset"] = offset;
+        group_metadata["columns"] = nlohmann::json::array();
+        for (const auto& name : group) {
+            group_metadata["columns"].push_back(*find_column_metadata(metadata, name));
+        }
+        new_groups.push_back(group_metadata);
+
+        // Stream the group's columns out row-major
+        QueryArena arena;
+        ScanCursor cursor(metadata, hty_file_path, group, std::nullopt, &arena);
+        Batch batch(&arena);
+        while (cursor.next(batch)) {
+            rows.resize(static_cast<size_t>(batch.num_rows) * group.size());
+            int32_t* out = rows.data();
+            for (int r = 0; r < batch.num_rows; ++r) {
+                for (const auto& column : batch.columns) {
+                    *out++ = column.data()[r];
+                }
+            }
+            if (swap) swap_values(rows.data(), rows.size());
+            out_file.write(reinterpret_cast<const char*>(rows.data()), rows.size() * sizeof(int32_t));
+            offset += rows.size() * sizeof(int32_t);
+        }
+    }
+
+    new_metadata["groups"] = new_groups;
+    new_metadata["num_groups"] = groups.size();
+
+    // The filters carry over unchanged under a new id, which binds the copy to
+    // the new file. A sidecar that does not belong to the source is dropped.
+    new_metadata.erase("bloom_file");
+    new_metadata.erase("bloom_id");
+    std::unique_ptr<MappedFile> bloom = map_bloom_file(schema);
+    if (bloom) {
+        std::string bloom_path = out_path + ".bloom";
+        std::string bloom_id = make_bloom_id();
+        std::string header = bloom_header(bloom_id);
+        std::ofstream bloom_file(bloom_path + ".tmp", std::ios::binary);
+        bloom_file.write(header.data(), header.size());
+        bloom_file.write(bloom->data() + kBloomHeaderBytes, bloom->size() - kBloomHeaderBytes);
+        bloom_file.close();
+        if (bloom_file.fail()) {
+            std::remove((bloom_path + ".tmp").c_str());
+            std::remove(temp_path.c_str());
+            throw std::runtime_error("Failed to write " + bloom_path + ".tmp");
+        }
+        replace_file(bloom_path + ".tmp", bloom_path);
+        new_metadata["bloom_file"] = std::filesystem::path(bloom_path).filename().string();
+        new_metadata["bloom_id"] = bloom_id;
+    } else {
+        for (auto& group : new_metadata["groups"]) {
+            for (auto& col : group["columns"]) col.erase("bloom");
+        }
+    }
+
+    std::string metadata_str = new_metadata.dump();
+    char metadata_size[sizeof(int32_t)];
+    store_big_endian(metadata_str.size(), metadata_size);
+    out_file.write(metadata_str.c_str(), metadata_str.size());
+    out_file.write(metadata_size, sizeof(metadata_size));
+    out_file.close();
+    if (out_file.fail()) {
+        std::remove(temp_path.c_str());
+        throw std::runtime_error("Failed to write " + temp_path);
+    }
+    replace_file(temp_path, out_path);
+}
+
+// Approximate answer with a 95% confidence half-width
+struct ApproxResult {
+    double estimate;
+    double error;
+    bool from_metadata;
+};
+
+// Function to pick a uniform random subset of block indices (without replacement)
+std::vector<int> sample_blocks(int num_blocks, double sample_fraction) {
+    std::vector<int> blocks(num_blocks);
+    std::iota(blocks.begin(), blocks.end(), 0);
+    int num_sampled = std::clamp(static_cast<int>(std::ceil(num_blocks * sample_fraction)), 1, std::max(num_blocks, 1));
+    std::mt19937 rng(std::random_device{}());
+    std::shuffle(blocks.begin(), blocks.end(), rng);
+    blocks.resize(std::min(num_sampled, num_blocks));
+    std::sort(blocks.begin(), blocks.end());  // read in file order
+    return blocks;
+}
+
+// Function to compute COUNT (aggregate 0), SUM (1) or AVG (2) of a column over
+// every row, streaming through a cursor. op < 0 means no WHERE clause.
+double exact_aggregate(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& column_name,
+    int aggregate, int op, int value) {
+    std::optional<ScanPredicate> predicate;
+    if (op >= 0) predicate = ScanPredicate{column_name, op, value, {}};
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, {column_name}, predicate, &arena);
+
+    double count = 0.0;
+    double sum = 0.0;
+    Batch batch(&arena);
+    while (cursor.next(batch)) {
+        const BatchColumn& column = batch.columns[0];
+        count += batch.num_rows;
+        for (int r = 0; r < batch.num_rows; ++r) {
+            sum += column.is_float ? column.float_at(r) : column.data()[r];
+        }
+    }
+    return aggregate == 0 ? count : aggregate == 1 ? sum : (count > 0 ? sum / count : 0.0);
+}
+
+// Function to decide a filter for every row of a column from the min and max
+// in its footer statistics. Rows are compared as ints with floats truncated,
+// which keeps their order, so truncated bounds decide exactly. Returns 1 when
+// every row matches, 0 when none does and -1 when only a scan can tell.
+int filter_from_range(const nlohmann::json& stats, int op, int value) {
+    int64_t lo = static_cast<int64_t>(stats["min"].get<double>());
+    int64_t hi = static_cast<int64_t>(stats["max"].get<double>());
+    bool outside = value < lo || value > hi;
+    bool single = lo == hi && lo == value;  // every row equals value
+    switch (op) {
+        case 0: return outside ? 0 : single ? 1 : -1;
+        case 1: return outside ? 1 : single ? 0 : -1;
+        case 2: return lo > value ? 1 : hi <= value ? 0 : -1;
+        case 3: return lo >= value ? 1 : hi < value ? 0 : -1;
+        case 4: return hi < value ? 1 : lo >= value ? 0 : -1;
+        case 5: return hi <= value ? 1 : lo > value ? 0 : -1;
+    }
+    return -1;
+}
+
+// Function to answer COUNT (aggregate 0), SUM (1) or AVG (2) exactly from a
+// column's footer statistics, when it has them and there is no filter or its
+// min and max decide the filter for every row
+std::optional<double> footer_aggregate(const nlohmann::json& column, int aggregate, int op, int value) {
+    if (!column.contains("stats")) return std::nullopt;
+    const auto& stats = column["stats"];
+    int matches = op < 0 ? 1 : filter_from_range(stats, op, value);
+    if (matches < 0) return std::nullopt;
+    double count = matches ? stats["count"].get<double>() : 0.0;
+    double sum = matches ? stats["sum"].get<double>() : 0.0;
+    return aggregate == 0 ? count : aggregate == 1 ? sum : (count > 0 ? sum / count : 0.0);
+}
+
+// Function to estimate COUNT (aggregate 0), SUM (1) or AVG (2) of a column from
+// a random sample of row blocks. op < 0 means no WHERE clause. Footer
+// statistics answer the query exactly when footer_aggregate can.
+ApproxResult approximate_aggregate(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& column_name,
+    int aggregate, int op, int value, double sample_fraction) {
+    ColumnLocation loc = locate_column(metadata, column_name);
+    int num_rows = metadata["num_rows"];
+
+    if (std::optional<double> exact = footer_aggregate(*find_column_metadata(metadata, column_name), aggregate, op, value)) {
+        return {*exact, 0.0, true};
+    }
+
+    // Sampling everything is just an exact scan
+    if (sample_fraction >= 1.0) {
+        return {exact_aggregate(metadata, hty_file_path, column_name, aggregate, op, value), 0.0, false};
+    }
+
+    std::ifstream hty_file(hty_file_path, std::ios::binary);
+    if (!hty_file.is_open()) {
+        throw std::runtime_error("File not found or could not be opened.");
+    }
+
+    int rows_per_block = block_rows(metadata);
+    int num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+    std::vector<int> blocks = sample_blocks(num_blocks, sample_fraction);
+    int n = blocks.size();
+
+    // Per-block matching counts (x) and sums (y)
+    std::vector<double> counts(n, 0.0), sums(n, 0.0);
+    bool swap = needs_swap(metadata);
+    QueryArena arena;
+    std::pmr::vector<char> buffer(&arena);
+    for (int b = 0; b < n; ++b) {
+        int first_row = blocks[b] * rows_per_block;
+        int count = std::min(rows_per_block, num_rows - first_row);
+        read_row_block(hty_file, loc.group_offset, loc.row_size, first_row, count, buffer);
+        for (int r = 0; r < count; ++r) {
+            double v = decode_value(buffer.data() + static_cast<size_t>(r) * loc.row_size + loc.byte_offset, loc.is_float, swap);
+            if (op >= 0 && !evaluate_predicate(static_cast<int>(v), op, value)) continue;
+            counts[b] += 1.0;
+            sums[b] += v;
+        }
+    }
+    hty_file.close();
+
+    if (n == 0) return {0.0, 0.0, false};
+
+    // Cluster-sampling estimators with finite population correction
+    double fpc = 1.0 - static_cast<double>(n) / num_blocks;
+    double total_count = std::accumulate(counts.begin(), counts.end(), 0.0);
+    double total_sum = std::accumulate(sums.begin(), sums.end(), 0.0);
+    auto sample_variance = [n](const std::vector<double>& xs) {
+        if (n < 2) return 0.0;
+        double mean = std::accumulate(xs.begin(), xs.end(), 0.0) / n;
+        double acc = 0.0;
+        for (double x : xs) acc += (x - mean) * (x - mean);
+        return acc / (n - 1);
+    };
+
+    if (aggregate == 0 || aggregate == 1) {
+        const std::vector<double>& ys = aggregate == 0 ? counts : sums;
+        double sampled_total = aggregate == 0 ? total_count : total_sum;
+        double estimate = num_blocks * sampled_total / n;
+        double variance = static_cast<double>(num_blocks) * num_blocks * fpc * sample_variance(ys) / n;
+        return {estimate, 1.96 * std::sqrt(variance), false};
+    }
+
+    // AVG as a ratio estimator sum(y) / sum(x)
+    if (total_count == 0) return {0.0, 0.0, false};
+    double ratio = total_sum / total_count;
+    std::vector<double> residuals(n);
+    for (int b = 0; b < n; ++b) residuals[b] = sums[b] - ratio * counts[b];
+    double mean_count = total_count / n;
+    double variance = fpc * sample_variance(residuals) / (n * mean_count * mean_count);
+    return {ratio, 1.96 * std::sqrt(variance), false};
 }
 
+// Function to estimate COUNT(DISTINCT column) with HyperLogLog, from the
+// footer sketch when present or a single pass over the column otherwise
+ApproxResult approximate_count_distinct(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& column_name) {
+    const nlohmann::json* column = find_column_metadata(metadata, column_name);
+    if (!column) {
+        throw std::runtime_error("Column not found: " + column_name);
+    }
+    if (column->contains("stats")) {
+        return {HyperLogLog::from_string((*column)["stats"]["hll"].get<std::string>()).estimate(), 0.0, true};
+    }
+
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, {column_name}, std::nullopt, &arena);
+    HyperLogLog hll;
+    Batch batch(&arena);
+    while (cursor.next(batch)) {
+        for (int r = 0; r < batch.num_rows; ++r) {
+            hll.add(static_cast<uint32_t>(batch.columns[0].data()[r]));
+        }
+    }
+    return {hll.estimate(), 0.0, false};
+}
+
+// Function to estimate the q-th quantile (0..1) of a column with a quantile
+// sketch, from the footer when present or from sampled row blocks otherwise.
+// The footer's min and max give the 0th and 100th exactly. No error bound is
+// estimated.
+ApproxResult approximate_percentile(const nlohmann::json& metadata, const std::string& hty_file_path, const std::string& column_name,
+    double q, double sample_fraction) {
+    ColumnLocation loc = locate_column(metadata, column_name);
+    const nlohmann::json& column = *find_column_metadata(metadata, column_name);
+    if (column.contains("stats")) {
+        const auto& stats = column["stats"];
+        if (q <= 0.0) return {stats["min"].get<double>(), 0.0, true};
+        if (q >= 1.0) return {stats["max"].get<double>(), 0.0, true};
+        return {QuantileSketch::from_string(stats["quantiles"].get<std::string>()).quantile(q), 0.0, true};
+    }
+
+    std::ifstream hty_file(hty_file_path, std::ios::binary);
+    if (!hty_file.is_open()) {
+        throw std::runtime_error("File not found or could not be opened.");
+    }
+    int num_rows = metadata["num_rows"];
+    int rows_per_block = block_rows(metadata);
+    int num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+    QuantileSketch sketch;
+    bool swap = needs_swap(metadata);
+    QueryArena arena;
+    std::pmr::vector<char> buffer(&arena);
+    for (int block : sample_blocks(num_blocks, sample_fraction)) {
+        int first_row = block * rows_per_block;
+        int count = std::min(rows_per_block, num_rows - first_row);
+        read_row_block(hty_file, loc.group_offset, loc.row_size, first_row, count, buffer);
+        for (int r = 0; r < count; ++r) {
+            sketch.add(static_cast<float>(decode_value(buffer.data() + static_cast<size_t>(r) * loc.row_size + loc.byte_offset, loc.is_float, swap)));
+        }
+    }
+    hty_file.close();
+    return {sketch.quantile(q), 0.0, false};
+}
 
 // Function to display the projected column data
 void display_column(nlohmann::json metadata, std::string column_name, std::vector<int> data) {
@@ -513,13 +2150,17 @@ void display_menu() {
     std::cout << "4. Project and filter columns\n";
     std::cout << "5. Add rows to the HTY file\n";  
     std::cout << "6. Exit\n";
+    std::cout << "7. Approximate aggregate\n";
+    std::cout << "8. Filter column data by an IN-list\n";
+    std::cout << "9. Export to CSV\n";
 }
 
 
 void display_column_data(const std::string& hty_file_path, const std::string& column_name, nlohmann::json& metadata) {
-    // Implement the display column functionality
-    std::vector<int> column_data = project_single_column(metadata, hty_file_path, column_name);
-    display_column(metadata, column_name, column_data);
+    // Stream the column instead of materializing it
+    QueryArena arena;
+    ScanCursor cursor(metadata, hty_file_path, {column_name}, std::nullopt, &arena);
+    display_batches(cursor);
 }
 
 std::vector<std::string> get_projected_columns() {
@@ -546,7 +2187,17 @@ std::vector<std::string> get_projected_columns() {
     return columns;
 }
 
-void add_row(nlohmann::json metadata, const std::string& hty_file_path, const std::string& modified_hty_file_path, const std::vector<std::vector<int>>& rows) {
+// Function to append rows to an .hty file, writing the result to a new file.
+// The result keeps the file's byte order unless `little_endian` asks for the
+// native little-endian layout, in which case the existing data is converted.
+void add_row(nlohmann::json metadata, const std::string& hty_file_path, const std::string& modified_hty_file_path,
+    const std::vector<std::vector<int>>& rows, bool little_endian = false) {
+    // New rows are appended after the data, which is the end of the only group
+    if (metadata["groups"].size() != 1) {
+        std::cerr << "Error: Rows can only be added to files with a single column group.\n";
+        return;
+    }
+
     std::ifstream in_file(hty_file_path, std::ios::binary);
     if (!in_file.is_open()) {
         std::cerr << "Error: Unable to open HTY file for reading.\n";
@@ -560,46 +2211,167 @@ void add_row(nlohmann::json metadata, const std::string& hty_file_path, const st
     // Update the metadata with the new number of rows
     metadata["num_rows"] = metadata["num_rows"].get<int>() + rows.size();
 
+    // Precomputed column statistics and Bloom filters no longer describe the data; drop them
+    for (auto& group : metadata["groups"]) {
+        for (auto& col : group["columns"]) {
+            col.erase("stats");
+            col.erase("bloom");
+        }
+    }
+    metadata.erase("bloom_file");
+    metadata.erase("bloom_id");
+
+    bool convert_existing = little_endian && !is_little_endian(metadata);
+    if (little_endian) {
+        metadata["byte_order"] = "little";
+    }
+
     // Write the updated metadata to a string
     std::string metadata_str = metadata.dump();
-    int32_t metadata_size = swap_endian_int(metadata_str.size());
+    char metadata_size[sizeof(int32_t)];
+    store_big_endian(metadata_str.size(), metadata_size);
 
-    // Open the modified HTY file for writing
-    std::ofstream out_file(modified_hty_file_path, std::ios::binary);
+    // Open a temporary file next to the modified HTY file for writing
+    std::string temp_path = modified_hty_file_path + ".tmp";
+    std::ofstream out_file(temp_path, std::ios::binary);
     if (!out_file.is_open()) {
         std::cerr << "Error: Unable to open modified HTY file for writing.\n";
         return;
     }
 
-    // Write the original content to the modified file excluding the old metadata and its size
-    out_file.write(file_content.data(), file_content.size() - sizeof(int32_t) - swap_endian_int(*reinterpret_cast<int32_t*>(&file_content[file_content.size() - sizeof(int32_t)])));
+    // The original data, excluding the old metadata and its size. Every value
+    // is 32 bits, so the whole section converts as one run.
+    int32_t old_metadata_size = load_big_endian(&file_content[file_content.size() - sizeof(int32_t)]);
+    size_t data_size = file_content.size() - sizeof(int32_t) - old_metadata_size;
+    std::vector<int32_t> data(data_size / sizeof(int32_t));
+    std::memcpy(data.data(), file_content.data(), data.size() * sizeof(int32_t));
+    if (convert_existing) {
+        swap_values(data.data(), data.size());
+    }
 
-    // Write the new rows to the modified file
+    // Append the new rows in the result's byte order
+    size_t first_new = data.size();
     for (const auto& row : rows) {
         for (size_t i = 0; i < row.size(); ++i) {
             const auto& value = row[i];
             std::string column_type = metadata["groups"][0]["columns"][i]["column_type"];
             if (column_type == "int") {
-                int32_t int_value = swap_endian_int(value);
-                out_file.write(reinterpret_cast<const char*>(&int_value), sizeof(int32_t));
+                data.push_back(value);
             } else if (column_type == "float") {
                 float float_value = static_cast<float>(value);
-                float_value = swap_endian_float(float_value);
-                out_file.write(reinterpret_cast<const char*>(&float_value), sizeof(float));
+                int32_t bits;
+                std::memcpy(&bits, &float_value, sizeof(bits));
+                data.push_back(bits);
             }
         }
     }
+    if (needs_swap(metadata)) {
+        swap_values(data.data() + first_new, data.size() - first_new);
+    }
+    out_file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(int32_t));
 
     // Write the updated metadata to the modified file
     out_file.write(metadata_str.c_str(), metadata_str.size());
-    out_file.write(reinterpret_cast<const char*>(&metadata_size), sizeof(metadata_size));
+    out_file.write(metadata_size, sizeof(metadata_size));
 
     out_file.close();
+    if (out_file.fail()) {
+        std::cerr << "Error: Failed to write the modified HTY file.\n";
+        std::remove(temp_path.c_str());
+        return;
+    }
+    replace_file(temp_path, modified_hty_file_path);
 }
 
 
-int main() {
+// Function to pick the default number of export threads
+int default_thread_count() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Function to parse a whole command-line argument as an int
+int parse_int_argument(const std::string& option, const std::string& text) {
+    int value = 0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc() || end != text.data() + text.size()) {
+        throw std::runtime_error("Invalid value for " + option + ": " + text);
+    }
+    return value;
+}
+
+// Function to parse the operation of --where: one of the statement
+// comparisons (=, !=, >, >=, <, <=) or its code 0-5 as the menu numbers them
+int parse_where_operation(const std::string& text) {
+    int op = find_operation(text);
+    if (op < 0 && text.size() == 1 && text[0] >= '0' && text[0] <= '5') op = text[0] - '0';
+    if (op < 0) throw std::runtime_error("Unknown --where operation: " + text);
+    return op;
+}
+
+// Usage: analyze.out [hty_file]
+//        analyze.out hty_file --export csv_file [--columns a,b,...] [--where column op value] [--threads n]
+//        (op is =, !=, >, >=, <, <= or its code 0-5)
+//        analyze.out hty_file --advise query_log [--relayout out_file]
+//        analyze.out hty_file --groups a,b;c,... --relayout out_file
+//        (--relayout keeps the file's byte order; add --little-endian to store it little-endian)
+//        analyze.out --serve socket_path [--threads n] [--log-queries query_log]
+int main(int argc, char* argv[]) {
     std::string hty_file_path = "src/output.hty"; // Path to your HTY file
+    std::string socket_path;
+    std::string query_log_path;
+    std::string advise_log_path;
+    std::string layout_spec;
+    std::string relayout_path;
+    bool little_endian = false;
+    std::string export_path;
+    std::vector<std::string> export_columns;
+    std::optional<ScanPredicate> export_predicate;
+    int export_threads = default_thread_count();  // also the server's pool size
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--export" && i + 1 < argc) {
+                export_path = argv[++i];
+            } else if (arg == "--columns" && i + 1 < argc) {
+                std::stringstream ss(argv[++i]);
+                std::string name;
+                while (std::getline(ss, name, ',')) {
+                    export_columns.push_back(name);
+                }
+            } else if (arg == "--where" && i + 3 < argc) {
+                std::string column = argv[i + 1];
+                export_predicate = ScanPredicate{column, parse_where_operation(argv[i + 2]), parse_int_argument(arg, argv[i + 3]), {}};
+                i += 3;
+            } else if (arg == "--threads" && i + 1 < argc) {
+                export_threads = parse_int_argument(arg, argv[++i]);
+                if (export_threads < 1) throw std::runtime_error("--threads must be at least 1");
+            } else if (arg == "--serve" && i + 1 < argc) {
+                socket_path = argv[++i];
+            } else if (arg == "--log-queries" && i + 1 < argc) {
+                query_log_path = argv[++i];
+            } else if (arg == "--advise" && i + 1 < argc) {
+                advise_log_path = argv[++i];
+            } else if (arg == "--groups" && i + 1 < argc) {
+                layout_spec = argv[++i];
+            } else if (arg == "--relayout" && i + 1 < argc) {
+                relayout_path = argv[++i];
+            } else if (arg == "--little-endian") {
+                little_endian = true;
+            } else {
+                hty_file_path = arg;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Server mode opens files on demand
+    if (!socket_path.empty()) {
+        return run_server(socket_path, export_threads, query_log_path);
+    }
+
     nlohmann::json metadata;
 
     // Extract the metadata first
@@ -610,107 +2382,239 @@ int main() {
         return 1;
     }
 
+    // Non-interactive export
+    if (!export_path.empty()) {
+        try {
+            size_t rows = export_to_csv(metadata, hty_file_path, export_path, export_columns, export_predicate, export_threads);
+            std::cout << "Exported " << rows << " rows to " << export_path << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Non-interactive layout advice and re-layout
+    if (!advise_log_path.empty() || !relayout_path.empty()) {
+        try {
+            std::vector<std::vector<std::string>> groups = parse_layout(layout_spec);
+            if (!advise_log_path.empty()) {
+                groups = advise_file_layout(metadata, hty_file_path, advise_log_path);
+            }
+            if (!relayout_path.empty()) {
+                if (groups.empty()) throw std::runtime_error("--relayout needs --advise or --groups.");
+                relayout_file(metadata, hty_file_path, relayout_path, groups, little_endian || is_little_endian(metadata));
+                std::cout << "Wrote " << groups.size() << " column groups to " << relayout_path << std::endl;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     int choice = 0;
     while (choice != 6) { // Change exit choice to 6
         display_menu();
         std::cin >> choice;
 
-        switch (choice) {
-            case 1: {
-                std::string column_name;
-                std::cout << "Enter the column name to display: ";
-                std::cin >> column_name;
-                display_column_data(hty_file_path, column_name, metadata);
-                break;
-            }
-            case 2: {
-                std::string column_name;
-                int operation;
-                int filtered_value;
-                
-                std::cout << "Enter the column name to filter: ";
-                std::cin >> column_name;    
-                std::cout << "Choose an operation (0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=): ";
-                std::cin >> operation;
-                std::cout << "Enter the value to filter: ";
-                std::cin >> filtered_value;
-
-                // Call the filter function
-                std::vector<int> filtered_data = filter(metadata, hty_file_path, column_name, operation, filtered_value);
+        // A failed query reports its error and returns to the menu
+        try {
+            switch (choice) {
+                case 1: {
+                    std::string column_name;
+                    std::cout << "Enter the column name to display: ";
+                    std::cin >> column_name;
+                    display_column_data(hty_file_path, column_name, metadata);
+                    break;
+                }
+                case 2: {
+                    std::string column_name;
+                    int operation;
+                    int filtered_value;
                 
-                // Display the filtered results
-                std::cout << "Filtered results for column " << column_name << ":\n";
-                for (const auto& value : filtered_data) {
-                    std::cout << value << std::endl;
+                    std::cout << "Enter the column name to filter: ";
+                    std::cin >> column_name;    
+                    std::cout << "Choose an operation (0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=): ";
+                    std::cin >> operation;
+                    std::cout << "Enter the value to filter: ";
+                    std::cin >> filtered_value;
+
+                    // Stream the filtered results
+                    QueryArena arena;
+                    ScanCursor cursor(metadata, hty_file_path, {column_name}, ScanPredicate{column_name, operation, filtered_value, {}}, &arena);
+                    std::cout << "Filtered results for column " << column_name << ":\n";
+                    display_batches(cursor, false);
+                    break;
                 }
-                break;
-            }
-            case 3: {
-                // Get the projected columns from user input
-                std::vector<std::string> projected_columns = get_projected_columns();
-                // Call the project function
-                std::vector<std::vector<int>> projected_data = project(metadata, hty_file_path, projected_columns);
-                break;
-            }
-            case 4: {
-                std::vector<std::string> projected_columns = get_projected_columns();
+                case 3: {
+                    // Get the projected columns from user input
+                    std::vector<std::string> projected_columns = get_projected_columns();
+                    QueryArena arena;
+                    ScanCursor cursor(metadata, hty_file_path, projected_columns, std::nullopt, &arena);
+                    display_batches(cursor);
+                    break;
+                }
+                case 4: {
+                    std::vector<std::string> projected_columns = get_projected_columns();
                 
-                std::string filtered_column;
-                int operation;
-                int filtered_value;
+                    std::string filtered_column;
+                    int operation;
+                    int filtered_value;
                 
-                std::cout << "Enter the column name to filter on: ";
-                std::cin >> filtered_column;
+                    std::cout << "Enter the column name to filter on: ";
+                    std::cin >> filtered_column;
                 
-                std::cout << "Choose an operation (0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=): ";
-                std::cin >> operation;
+                    std::cout << "Choose an operation (0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=): ";
+                    std::cin >> operation;
                 
-                std::cout << "Enter the value to filter by: ";
-                std::cin >> filtered_value;
+                    std::cout << "Enter the value to filter by: ";
+                    std::cin >> filtered_value;
                 
-                // Call the project_and_filter function
-                std::vector<std::vector<int>> result = project_and_filter(
-                    metadata, hty_file_path, projected_columns, filtered_column, operation, filtered_value
-                );
-                break;
-            }
-            case 5: {
-                // Ask for the modified HTY file path
-                std::string modified_hty_file_path = "src/modified_output.hty";
-                // Ask for the number of rows to add
-                int num_rows;
-                std::cout << "Enter the number of rows to add: ";
-                std::cin >> num_rows;
-
-                // Collect the rows of data
-                std::vector<std::vector<int>> rows;
-                for (int i = 0; i < num_rows; ++i) {
-                    std::cout << "Enter data for row " << i + 1 << ":\n";
-                    std::vector<int> row_data;
-
-                    // Assuming the number of columns is known or can be inferred
-                    int num_columns = 3; // Change this to match the number of columns in your file
-
-                    for (int j = 0; j < num_columns; ++j) {
-                        int value;
-                        std::cout << "Enter value for column " << j + 1 << ": ";
-                        std::cin >> value;
-                        row_data.push_back(value);
+                    QueryArena arena;
+                    ScanCursor cursor(metadata, hty_file_path, projected_columns, ScanPredicate{filtered_column, operation, filtered_value, {}}, &arena);
+                    display_batches(cursor);
+                    break;
+                }
+                case 5: {
+                    // Ask for the modified HTY file path
+                    std::string modified_hty_file_path = "src/modified_output.hty";
+                    // Ask for the number of rows to add
+                    int num_rows;
+                    std::cout << "Enter the number of rows to add: ";
+                    std::cin >> num_rows;
+
+                    // Collect the rows of data
+                    std::vector<std::vector<int>> rows;
+                    for (int i = 0; i < num_rows; ++i) {
+                        std::cout << "Enter data for row " << i + 1 << ":\n";
+                        std::vector<int> row_data;
+
+                        // Assuming the number of columns is known or can be inferred
+                        int num_columns = 3; // Change this to match the number of columns in your file
+
+                        for (int j = 0; j < num_columns; ++j) {
+                            int value;
+                            std::cout << "Enter value for column " << j + 1 << ": ";
+                            std::cin >> value;
+                            row_data.push_back(value);
+                        }
+
+                        rows.push_back(row_data);
+                    }
+
+                    std::string answer;
+                    std::cout << "Store the modified file little-endian? (y/n): ";
+                    std::cin >> answer;
+
+                    // Call the add_row function with the collected rows
+                    add_row(metadata, hty_file_path, modified_hty_file_path, rows, answer == "y");
+                    break;
+                }
+                case 6:
+                    std::cout << "Exiting...\n";
+                    break;
+                case 7: {
+                    std::string column_name;
+                    int aggregate;
+                    std::cout << "Enter the column name to aggregate: ";
+                    std::cin >> column_name;
+                    std::cout << "Choose an aggregate (0: COUNT, 1: SUM, 2: AVG, 3: COUNT DISTINCT, 4: PERCENTILE): ";
+                    std::cin >> aggregate;
+
+                    // Only ask for a sample fraction when the footer statistics
+                    // cannot answer the query and rows have to be read
+                    const nlohmann::json* column = find_column_metadata(metadata, column_name);
+                    bool has_stats = column && column->contains("stats");
+                    auto get_sample_fraction = []() {
+                        double sample_fraction;
+                        std::cout << "Enter the fraction of row blocks to sample (0-1]: ";
+                        std::cin >> sample_fraction;
+                        return sample_fraction;
+                    };
+
+                    if (aggregate == 3) {
+                        ApproxResult result = approximate_count_distinct(metadata, hty_file_path, column_name);
+                        std::cout << "~" << result.estimate << (result.from_metadata ? " (from footer statistics)" : "") << std::endl;
+                    } else if (aggregate == 4) {
+                        double sample_fraction = has_stats ? 1.0 : get_sample_fraction();
+                        double percentile;
+                        std::cout << "Enter the percentile (0-100): ";
+                        std::cin >> percentile;
+                        ApproxResult result = approximate_percentile(metadata, hty_file_path, column_name, percentile / 100.0, sample_fraction);
+                        std::cout << "~" << result.estimate << (result.from_metadata ? " (from footer statistics)" : "") << std::endl;
+                    } else {
+                        int operation;
+                        int filtered_value = 0;
+                        std::cout << "Choose a filter operation (-1: none, 0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=): ";
+                        std::cin >> operation;
+                        if (operation >= 0) {
+                            std::cout << "Enter the value to filter by: ";
+                            std::cin >> filtered_value;
+                        }
+                        bool from_footer = column && footer_aggregate(*column, aggregate, operation, filtered_value);
+                        double sample_fraction = from_footer ? 1.0 : get_sample_fraction();
+                        ApproxResult result = approximate_aggregate(
+                            metadata, hty_file_path, column_name, aggregate, operation, filtered_value, sample_fraction
+                        );
+                        std::cout << "~" << result.estimate << " +/- " << result.error
+                                  << (result.from_metadata ? " (from footer statistics)" : "") << std::endl;
+                    }
+                    break;
+                }
+                case 8: {
+                    std::string column_name;
+                    int num_values;
+                    std::cout << "Enter the column name to filter: ";
+                    std::cin >> column_name;
+                    std::cout << "Enter the number of values in the list: ";
+                    std::cin >> num_values;
+
+                    std::vector<int> values;
+                    for (int i = 0; i < num_values; ++i) {
+                        int v;
+                        std::cout << "Enter value " << i + 1 << ": ";
+                        std::cin >> v;
+                        values.push_back(v);
                     }
 
-                    rows.push_back(row_data);
+                    QueryArena arena;
+                    ScanCursor cursor(metadata, hty_file_path, {column_name}, ScanPredicate{column_name, kOpIn, 0, values}, &arena);
+                    std::cout << "Filtered results for column " << column_name << ":\n";
+                    display_batches(cursor, false);
+                    break;
                 }
+                case 9: {
+                    std::string csv_file_path;
+                    std::cout << "Enter the CSV file to write: ";
+                    std::cin >> csv_file_path;
+                    // 'done' straight away exports every column
+                    std::vector<std::string> columns = get_projected_columns();
+
+                    int operation;
+                    std::optional<ScanPredicate> predicate;
+                    std::cout << "Choose a filter operation (-1: none, 0: =, 1: !=, 2: >, 3: >=, 4: <, 5: <=): ";
+                    std::cin >> operation;
+                    if (operation >= 0) {
+                        std::string filtered_column;
+                        int filtered_value;
+                        std::cout << "Enter the column name to filter on: ";
+                        std::cin >> filtered_column;
+                        std::cout << "Enter the value to filter by: ";
+                        std::cin >> filtered_value;
+                        predicate = ScanPredicate{filtered_column, operation, filtered_value, {}};
+                    }
 
-                // Call the add_row function with the collected rows
-                add_row(metadata, hty_file_path, modified_hty_file_path, rows);
-                break;
+                    size_t rows = export_to_csv(metadata, hty_file_path, csv_file_path, columns, predicate, default_thread_count());
+                    std::cout << "Exported " << rows << " rows to " << csv_file_path << std::endl;
+                    break;
+                }
+                default:
+                    std::cout << "Invalid choice. Please try again.\n";
+                    break;
             }
-            case 6:
-                std::cout << "Exiting...\n";
-                break;
-            default:
-                std::cout << "Invalid choice. Please try again.\n";
-                break;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
         }
     }
 
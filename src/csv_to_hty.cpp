@@ -3,28 +3,74 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
 #include <jsoncpp/json/json.h>
+#include "hty_sketch.hpp"
 
-// Helper functions to convert data to binary in big-endian format
-void write_int32(std::ofstream& ofs, int32_t value) {
-    // Convert to big-endian format
+// Helper functions to convert data to binary in big-endian format, or
+// little-endian when asked
+void write_int32(std::ofstream& ofs, int32_t value, bool little_endian = false) {
     uint8_t bytes[4];
-    bytes[0] = (value >> 24) & 0xFF; // Most significant byte
-    bytes[1] = (value >> 16) & 0xFF;
-    bytes[2] = (value >> 8) & 0xFF;
-    bytes[3] = value & 0xFF;         // Least significant byte
+    if (little_endian) {
+        bytes[0] = value & 0xFF;         // Least significant byte
+        bytes[1] = (value >> 8) & 0xFF;
+        bytes[2] = (value >> 16) & 0xFF;
+        bytes[3] = (value >> 24) & 0xFF;
+    } else {
+        bytes[0] = (value >> 24) & 0xFF; // Most significant byte
+        bytes[1] = (value >> 16) & 0xFF;
+        bytes[2] = (value >> 8) & 0xFF;
+        bytes[3] = value & 0xFF;         // Least significant byte
+    }
     ofs.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
 }
 
-void write_float32(std::ofstream& ofs, float value) {
+void write_float32(std::ofstream& ofs, float value, bool little_endian = false) {
     // Convert to integer representation first
-    int32_t int_value = *reinterpret_cast<int32_t*>(&value);
+    int32_t int_value;
+    std::memcpy(&int_value, &value, sizeof(int_value));
     
-    // Then write it as big-endian
-    write_int32(ofs, int_value);
+    // Then write it in the requested byte order
+    write_int32(ofs, int_value, little_endian);
 }
 
-void convert_from_csv_to_hty(std::string csv_file_path, std::string hty_file_path) {
+// Per-column summary written to the footer so approximate queries can be
+// answered from the metadata alone
+struct ColumnSketch {
+    int64_t count = 0;
+    double sum = 0.0;
+    double min = 0.0;
+    double max = 0.0;
+    HyperLogLog distinct;
+    QuantileSketch quantiles;
+
+    void add(double value, uint32_t bits) {
+        if (count == 0 || value < min) min = value;
+        if (count == 0 || value > max) max = value;
+        ++count;
+        sum += value;
+        distinct.add(bits);
+        quantiles.add(static_cast<float>(value));
+    }
+
+    Json::Value to_json() const {
+        Json::Value stats;
+        stats["count"] = static_cast<Json::Int64>(count);
+        stats["sum"] = sum;
+        stats["min"] = min;
+        stats["max"] = max;
+        stats["hll"] = distinct.to_string();
+        stats["quantiles"] = quantiles.to_string();
+        return stats;
+    }
+};
+
+// Rows covered by each Bloom filter; also recorded as "block_rows" in the footer
+const int kBlockRows = 4096;
+
+void convert_from_csv_to_hty(std::string csv_file_path, std::string hty_file_path, bool with_sketches = false,
+    std::vector<std::string> bloom_columns = {}, bool little_endian = false) {
     std::ifstream csv_file(csv_file_path);
     if (!csv_file.is_open()) {
         std::cerr << "Error: Unable to open CSV file.\n";
@@ -46,21 +92,35 @@ void convert_from_csv_to_hty(std::string csv_file_path, std::string hty_file_pat
     int num_rows = csv_data.size();
     int num_columns = csv_data[0].size();
 
-    std::ofstream hty_file(hty_file_path, std::ios::binary);
+    // Write to temporary files and rename them into place at the end, so a
+    // reader that has the old file mapped keeps a complete (old) copy instead
+    // of seeing it truncated underneath it
+    std::string hty_temp_path = hty_file_path + ".tmp";
+    std::ofstream hty_file(hty_temp_path, std::ios::binary);
     if (!hty_file.is_open()) {
         std::cerr << "Error: Unable to open HTY file.\n";
         return;
     }
 
+    std::vector<ColumnSketch> sketches(with_sketches ? num_columns : 0);
+
     // Writing raw data
     for (const auto& row : csv_data) {
         for (int i = 0; i < num_columns; ++i) {
             if (i == 2) {  // Assuming the 3rd column is float
                 float float_value = std::stof(row[i]);
-                write_float32(hty_file, float_value);
+                write_float32(hty_file, float_value, little_endian);
+                if (with_sketches) {
+                    uint32_t bits;
+                    std::memcpy(&bits, &float_value, sizeof(bits));
+                    sketches[i].add(float_value, bits);
+                }
             } else {
                 int32_t int_value = std::stoi(row[i]);
-                write_int32(hty_file, int_value);
+                write_int32(hty_file, int_value, little_endian);
+                if (with_sketches) {
+                    sketches[i].add(int_value, static_cast<uint32_t>(int_value));
+                }
             }
         }
     }
@@ -69,6 +129,13 @@ void convert_from_csv_to_hty(std::string csv_file_path, std::string hty_file_pat
     Json::Value metadata;
     metadata["num_rows"] = num_rows;
     metadata["num_groups"] = 1;
+    metadata["block_rows"] = kBlockRows;
+    if (little_endian) {
+        // Values are stored in x86's native order; readers skip byte swapping.
+        // The metadata size below stays big-endian so the footer can be found
+        // before the byte order is known.
+        metadata["byte_order"] = "little";
+    }
 
     Json::Value group;
     group["num_columns"] = num_columns;
@@ -90,6 +157,75 @@ void convert_from_csv_to_hty(std::string csv_file_path, std::string hty_file_pat
     column3["column_type"] = "float";
     columns.append(column3);
 
+    if (with_sketches) {
+        for (int i = 0; i < num_columns && i < static_cast<int>(columns.size()); ++i) {
+            columns[i]["stats"] = sketches[i].to_json();
+        }
+    }
+
+    // One Bloom filter per block of kBlockRows rows for each requested int
+    // column, written back to back into a sidecar file next to the .hty file
+    // after a header that ties it to this write. Every filter is sized for a
+    // full block so readers can seek straight to it.
+    std::string bloom_file_path = hty_file_path + ".bloom";
+    std::string bloom_temp_path = bloom_file_path + ".tmp";
+    std::string bloom_id = make_bloom_id();
+    std::ofstream bloom_file;
+    int64_t bloom_offset = kBloomHeaderBytes;
+    for (Json::ArrayIndex i = 0; i < columns.size() && static_cast<int>(i) < num_columns; ++i) {
+        std::string name = columns[i]["column_name"].asString();
+        bool wanted = false;
+        for (const auto& bloom_column : bloom_columns) {
+            wanted = wanted || bloom_column == name;
+        }
+        if (!wanted) continue;
+        if (columns[i]["column_type"].asString() != "int") {
+            std::cerr << "Warning: Bloom filters are only built for int columns, skipping " << name << ".\n";
+            continue;
+        }
+
+        if (!bloom_file.is_open()) {
+            bloom_file.open(bloom_temp_path, std::ios::binary);
+            if (!bloom_file.is_open()) {
+                std::cerr << "Error: Unable to open Bloom filter file.\n";
+                hty_file.close();
+                std::remove(hty_temp_path.c_str());
+                return;
+            }
+            std::string header = bloom_header(bloom_id);
+            bloom_file.write(header.data(), header.size());
+        }
+
+        size_t num_words = BloomFilter(kBlockRows).num_words();
+        for (int first_row = 0; first_row < num_rows; first_row += kBlockRows) {
+            int last_row = std::min(first_row + kBlockRows, num_rows);
+            BloomFilter bloom(kBlockRows);
+            for (int row = first_row; row < last_row; ++row) {
+                bloom.add(static_cast<uint32_t>(std::stoi(csv_data[row][i])));
+            }
+            std::string bytes = bloom.to_bytes();
+            bloom_file.write(bytes.data(), bytes.size());
+        }
+
+        Json::Value bloom;
+        bloom["offset"] = static_cast<Json::Int64>(bloom_offset);
+        bloom["words"] = static_cast<Json::UInt64>(num_words);
+        columns[i]["bloom"] = bloom;
+        bloom_offset += static_cast<int64_t>(num_words) * 8 * ((num_rows + kBlockRows - 1) / kBlockRows);
+    }
+    if (bloom_file.is_open()) {
+        bloom_file.close();
+        if (std::rename(bloom_temp_path.c_str(), bloom_file_path.c_str()) != 0) {
+            std::cerr << "Error: Unable to replace " << bloom_file_path << ".\n";
+            hty_file.close();
+            std::remove(hty_temp_path.c_str());
+            return;
+        }
+        // Stored relative to the .hty file so the pair can be moved together
+        metadata["bloom_file"] = bloom_file_path.substr(bloom_file_path.find_last_of('/') + 1);
+        metadata["bloom_id"] = bloom_id;
+    }
+
     group["columns"] = columns;
     metadata["groups"].append(group);
 
@@ -104,11 +240,40 @@ void convert_from_csv_to_hty(std::string csv_file_path, std::string hty_file_pat
     write_int32(hty_file, metadata_size);
 
     hty_file.close();
+    if (hty_file.fail() || std::rename(hty_temp_path.c_str(), hty_file_path.c_str()) != 0) {
+        std::cerr << "Error: Unable to replace " << hty_file_path << ".\n";
+        std::remove(hty_temp_path.c_str());
+    }
 }
 
-int main() {
+// Usage: convert.out [--sketches] [--bloom col1,col2,...] [--little-endian] [csv_file] [hty_file]
+int main(int argc, char* argv[]) {
     std::string csv_file_path = "src/data.csv";
     std::string hty_file_path = "src/output.hty";
-    convert_from_csv_to_hty(csv_file_path, hty_file_path);
+    bool with_sketches = false;
+    bool little_endian = false;
+    std::vector<std::string> bloom_columns;
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--sketches") {
+            with_sketches = true;
+        } else if (arg == "--little-endian") {
+            little_endian = true;
+        } else if (arg == "--bloom" && i + 1 < argc) {
+            std::stringstream ss(argv[++i]);
+            std::string name;
+            while (std::getline(ss, name, ',')) {
+                bloom_columns.push_back(name);
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() > 0) csv_file_path = positional[0];
+    if (positional.size() > 1) hty_file_path = positional[1];
+
+    convert_from_csv_to_hty(csv_file_path, hty_file_path, with_sketches, bloom_columns, little_endian);
     return 0;
 }
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Thin client for `analyze.out --serve`: sends statements over the Unix domain
+// socket and streams each framed result to stdout.
+
+// Function to read exactly `size` bytes from a socket
+bool recv_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, data, size, 0);
+        if (received <= 0) return false;
+        data += received;
+        size -= received;
+    }
+    return true;
+}
+
+// Function to check whether a line holds a statement. The server skips lines
+// of only spaces, tabs and carriage returns without answering, so they must
+// not be sent.
+bool is_statement(const std::string& line) {
+    return line.find_first_not_of(" \t\r") != std::string::npos;
+}
+
+// Function to send one statement and copy its response to stdout. Frames are
+// a big-endian 32-bit length followed by that many bytes; an empty frame ends
+// the response. Sets `failed` when the server answered with an error.
+bool run_statement(int fd, const std::string& statement, bool& failed) {
+    std::string line = statement + "\n";
+    if (send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+        return false;
+    }
+
+    std::vector<char> payload;
+    while (true) {
+        unsigned char length_bytes[4];
+        if (!recv_all(fd, reinterpret_cast<char*>(length_bytes), sizeof(length_bytes))) return false;
+        uint32_t length = (static_cast<uint32_t>(length_bytes[0]) << 24) | (length_bytes[1] << 16) | (length_bytes[2] << 8) | length_bytes[3];
+        if (length == 0) break;
+        payload.resize(length);
+        if (!recv_all(fd, payload.data(), length)) return false;
+        if (payload.size() >= 7 && std::memcmp(payload.data(), "ERROR: ", 7) == 0) failed = true;
+        std::cout.write(payload.data(), length);
+    }
+    std::cout.flush();
+    return true;
+}
+
+// Usage: client.out socket_path [statement]
+// Without a statement, statements are read from stdin one per line. Exits
+// non-zero if any statement failed.
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " socket_path [statement]\n";
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Error: Unable to connect to " << argv[1] << ".\n";
+        return 1;
+    }
+
+    bool ok = true;
+    bool failed = false;
+    if (argc > 2) {
+        std::string statement;
+        for (int i = 2; i < argc; ++i) {
+            statement += (i > 2 ? " " : "") + std::string(argv[i]);
+        }
+        if (is_statement(statement)) ok = run_statement(fd, statement, failed);
+    } else {
+        std::string statement;
+        while (ok && std::getline(std::cin, statement)) {
+            if (is_statement(statement)) ok = run_statement(fd, statement, failed);
+        }
+    }
+
+    close(fd);
+    if (!ok) {
+        std::cerr << "Error: Connection to the server was lost.\n";
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
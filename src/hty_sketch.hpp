@@ -0,0 +1,323 @@
+#ifndef HTY_SKETCH_HPP
+#define HTY_SKETCH_HPP
+
+// Summaries shared by the converter (which can precompute them) and the
+// analyzer (which answers queries from them). Sketches serialize to plain
+// strings so either JSON library can store them in the footer without knowing
+// their layout; Bloom filters serialize to raw bytes for a sidecar file.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// 64-bit finalizer from SplitMix64, used to spread 32-bit column values
+inline uint64_t hash_value(uint32_t bits) {
+    uint64_t x = static_cast<uint64_t>(bits) + 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// HyperLogLog distinct counter with 2^10 registers (~3.25% standard error)
+class HyperLogLog {
+public:
+    static constexpr int kPrecision = 10;
+    static constexpr int kNumRegisters = 1 << kPrecision;
+
+    HyperLogLog() : registers_(kNumRegisters, 0) {}
+
+    void add(uint32_t bits) {
+        uint64_t h = hash_value(bits);
+        uint32_t index = static_cast<uint32_t>(h >> (64 - kPrecision));
+        uint64_t rest = h << kPrecision;
+        uint8_t rank = rest == 0 ? static_cast<uint8_t>(64 - kPrecision + 1)
+                                 : static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        if (rank > registers_[index]) {
+            registers_[index] = rank;
+        }
+    }
+
+    void merge(const HyperLogLog& other) {
+        for (int i = 0; i < kNumRegisters; ++i) {
+            registers_[i] = std::max(registers_[i], other.registers_[i]);
+        }
+    }
+
+    double estimate() const {
+        const double m = kNumRegisters;
+        double alpha = 0.7213 / (1.0 + 1.079 / m);
+        double sum = 0.0;
+        int zeros = 0;
+        for (uint8_t r : registers_) {
+            sum += std::ldexp(1.0, -r);
+            if (r == 0) ++zeros;
+        }
+        double raw = alpha * m * m / sum;
+        // Small-range correction: fall back to linear counting
+        if (raw <= 2.5 * m && zeros > 0) {
+            return m * std::log(m / zeros);
+        }
+        return raw;
+    }
+
+    // Registers as a hex string, two characters per register
+    std::string to_string() const {
+        static const char kHex[] = "0123456789abcdef";
+        std::string out;
+        out.reserve(kNumRegisters * 2);
+        for (uint8_t r : registers_) {
+            out.push_back(kHex[r >> 4]);
+            out.push_back(kHex[r & 0xF]);
+        }
+        return out;
+    }
+
+    static HyperLogLog from_string(const std::string& text) {
+        if (text.size() != static_cast<size_t>(kNumRegisters) * 2) {
+            throw std::runtime_error("Malformed HyperLogLog sketch.");
+        }
+        HyperLogLog hll;
+        for (int i = 0; i < kNumRegisters; ++i) {
+            hll.registers_[i] = static_cast<uint8_t>(std::stoi(text.substr(i * 2, 2), nullptr, 16));
+        }
+        return hll;
+    }
+
+private:
+    std::vector<uint8_t> registers_;
+};
+
+// KLL-style quantile sketch: a stack of compactors where level h holds items
+// of weight 2^h. Mergeable, with rank error around 1.7/k.
+class QuantileSketch {
+public:
+    explicit QuantileSketch(int k = 200) : k_(k), n_(0), rng_(0x2545F4914F6CDD1DULL) {
+        levels_.emplace_back();
+    }
+
+    // Non-finite values have no rank and could not be written back out by
+    // to_string, so they are left out
+    void add(float value) {
+        if (!std::isfinite(value)) return;
+        levels_[0].push_back(value);
+        ++n_;
+        if (levels_[0].size() >= capacity(0)) {
+            compress();
+        }
+    }
+
+    void merge(const QuantileSketch& other) {
+        while (levels_.size() < other.levels_.size()) {
+            levels_.emplace_back();
+        }
+        for (size_t h = 0; h < other.levels_.size(); ++h) {
+            levels_[h].insert(levels_[h].end(), other.levels_[h].begin(), other.levels_[h].end());
+        }
+        n_ += other.n_;
+        compress();
+    }
+
+    uint64_t count() const { return n_; }
+
+    // Value at normalized rank q in [0, 1]
+    float quantile(double q) const {
+        std::vector<std::pair<float, uint64_t>> weighted;
+        for (size_t h = 0; h < levels_.size(); ++h) {
+            for (float v : levels_[h]) {
+                weighted.push_back({v, uint64_t{1} << h});
+            }
+        }
+        if (weighted.empty()) {
+            throw std::runtime_error("Quantile of an empty sketch.");
+        }
+        std::sort(weighted.begin(), weighted.end());
+        uint64_t total = 0;
+        for (const auto& w : weighted) total += w.second;
+        double target = std::clamp(q, 0.0, 1.0) * total;
+        uint64_t seen = 0;
+        for (const auto& w : weighted) {
+            seen += w.second;
+            if (seen >= target) return w.first;
+        }
+        return weighted.back().first;
+    }
+
+    // "k n|level0 values|level1 values|..." with round-trippable floats
+    std::string to_string() const {
+        std::ostringstream out;
+        out << k_ << ' ' << n_;
+        char buf[32];
+        for (const auto& level : levels_) {
+            out << '|';
+            for (size_t i = 0; i < level.size(); ++i) {
+                std::snprintf(buf, sizeof(buf), "%.9g", level[i]);
+                out << (i ? " " : "") << buf;
+            }
+        }
+        return out.str();
+    }
+
+    static QuantileSketch from_string(const std::string& text) {
+        std::istringstream in(text);
+        std::string header;
+        std::getline(in, header, '|');
+        std::istringstream header_in(header);
+        int k;
+        uint64_t n;
+        if (!(header_in >> k >> n)) {
+            throw std::runtime_error("Malformed quantile sketch.");
+        }
+        QuantileSketch sketch(k);
+        sketch.n_ = n;
+        sketch.levels_.clear();
+        std::string level_text;
+        while (std::getline(in, level_text, '|')) {
+            std::istringstream level_in(level_text);
+            std::vector<float> level;
+            float v;
+            while (level_in >> v) level.push_back(v);
+            sketch.levels_.push_back(std::move(level));
+        }
+        if (sketch.levels_.empty()) sketch.levels_.emplace_back();
+        return sketch;
+    }
+
+private:
+    size_t capacity(size_t h) const {
+        size_t depth = levels_.size() - 1 - h;
+        return std::max<size_t>(2, static_cast<size_t>(std::ceil(k_ * std::pow(2.0 / 3.0, depth))));
+    }
+
+    void compress() {
+        for (size_t h = 0; h < levels_.size(); ++h) {
+            if (levels_[h].size() < capacity(h)) continue;
+            if (h + 1 == levels_.size()) levels_.emplace_back();
+            std::vector<float>& level = levels_[h];
+            std::sort(level.begin(), level.end());
+            // Keep one item back when odd so the promoted weight stays exact
+            float leftover = 0.0f;
+            bool has_leftover = level.size() % 2 == 1;
+            if (has_leftover) {
+                leftover = level.back();
+                level.pop_back();
+            }
+            rng_ ^= rng_ << 13;
+            rng_ ^= rng_ >> 7;
+            rng_ ^= rng_ << 17;
+            size_t start = rng_ & 1;
+            for (size_t i = start; i < level.size(); i += 2) {
+                levels_[h + 1].push_back(level[i]);
+            }
+            level.clear();
+            if (has_leftover) level.push_back(leftover);
+        }
+    }
+
+    int k_;
+    uint64_t n_;
+    uint64_t rng_;
+    std::vector<std::vector<float>> levels_;
+};
+
+// Bloom filter over 32-bit values, sized at ~10 bits per item (about 1% false
+// positives) with 7 probes derived by double hashing
+class BloomFilter {
+public:
+    static constexpr int kBitsPerItem = 10;
+    static constexpr int kNumProbes = 7;
+
+    explicit BloomFilter(size_t expected_items = 0)
+        : words_(std::max<size_t>(1, (expected_items * kBitsPerItem + 63) / 64), 0) {}
+
+    void add(uint32_t bits) {
+        uint64_t h = hash_value(bits);
+        uint64_t num_bits = words_.size() * 64;
+        for (int i = 0; i < kNumProbes; ++i) {
+            uint64_t bit = probe(h, i) % num_bits;
+            words_[bit / 64] |= uint64_t{1} << (bit % 64);
+        }
+    }
+
+    bool might_contain(uint32_t bits) const {
+        uint64_t h = hash_value(bits);
+        uint64_t num_bits = words_.size() * 64;
+        for (int i = 0; i < kNumProbes; ++i) {
+            uint64_t bit = probe(h, i) % num_bits;
+            if (!(words_[bit / 64] & (uint64_t{1} << (bit % 64)))) return false;
+        }
+        return true;
+    }
+
+    size_t num_words() const { return words_.size(); }
+
+    // Bit array as big-endian 64-bit words, for the binary sidecar file
+    std::string to_bytes() const {
+        std::string out(words_.size() * 8, '\0');
+        for (size_t i = 0; i < words_.size(); ++i) {
+            for (int b = 0; b < 8; ++b) {
+                out[i * 8 + b] = static_cast<char>((words_[i] >> (56 - 8 * b)) & 0xFF);
+            }
+        }
+        return out;
+    }
+
+    // Probe a filter in its serialized form without decoding it, so readers
+    // can test filters straight out of a buffer or a memory mapping
+    static bool might_contain(const char* data, size_t num_words, uint32_t bits) {
+        uint64_t h = hash_value(bits);
+        uint64_t num_bits = num_words * 64;
+        for (int i = 0; i < kNumProbes; ++i) {
+            uint64_t bit = probe(h, i) % num_bits;
+            // Bit b of a big-endian word sits in byte 7 - b / 8 of that word
+            uint8_t byte = static_cast<uint8_t>(data[(bit / 64) * 8 + 7 - (bit % 64) / 8]);
+            if (!(byte & (1u << (bit % 8)))) return false;
+        }
+        return true;
+    }
+
+private:
+    static uint64_t probe(uint64_t h, int i) {
+        uint64_t h1 = h & 0xFFFFFFFFULL;
+        uint64_t h2 = (h >> 32) | 1;
+        return h1 + i * h2;
+    }
+
+    std::vector<uint64_t> words_;
+};
+
+// A Bloom sidecar starts with a header naming the write that produced it, and
+// the .hty footer records the same id as "bloom_id". The two files are
+// replaced one after the other, so a reader can see one from another write;
+// filters whose header does not match the footer must not be trusted.
+constexpr char kBloomMagic[] = "HTYBLOOM";
+constexpr size_t kBloomHeaderBytes = 24;  // the magic, then the id as 16 hex digits
+
+// Function to make a fresh id for a sidecar about to be written
+inline std::string make_bloom_id() {
+    std::random_device device;
+    uint64_t id = (static_cast<uint64_t>(device()) << 32) | device();
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(id));
+    return text;
+}
+
+// Function to build the header that starts a sidecar with the given id
+inline std::string bloom_header(const std::string& id) {
+    return std::string(kBloomMagic, 8) + id;
+}
+
+// Function to check that a sidecar's first bytes carry the footer's id
+inline bool bloom_header_matches(const char* data, size_t size, const std::string& id) {
+    return size >= kBloomHeaderBytes && id.size() == kBloomHeaderBytes - 8 &&
+        std::memcmp(data, kBloomMagic, 8) == 0 && std::memcmp(data + 8, id.data(), id.size()) == 0;
+}
+
+#endif  // HTY_SKETCH_HPP